@@ -159,14 +159,25 @@ int http_server(const char* host, int port) {
     if (hlen > MAX_BUF) hlen = MAX_BUF;
     sans_send_pkt(sock, hdr, hlen);
 
-    // 6) Stream the file in ≤1024-byte chunks until all bytes are sent
+    // 6) Stream the file in ≤1024-byte chunks until all bytes are sent.
+    //    On RUDP, read straight into the socket's send buffers so nothing is
+    //    copied again, as much per packet as the path carries unfragmented;
+    //    other sockets fall back to a local buffer.
     char buf[MAX_BUF];
     for (;;) {
-        size_t r = fread(buf, 1, MAX_BUF, fp);
-        if (r == 0) break; // EOF or read error treated as EOF
-        // Each packet must be ≤ 1024 bytes
-        sans_send_pkt(sock, buf, (int)r);
-        if (r < MAX_BUF) break; // EOF
+        char *out = sans_get_buf(sock);
+        size_t want = MAX_BUF;
+        if (!out) out = buf;
+        else want = (size_t)rudp_max_payload(sock);
+        size_t r = fread(out, 1, want, fp);
+        if (r == 0) { // EOF or read error treated as EOF
+            if (out != buf) sans_put_buf(sock, out);
+            break;
+        }
+        // Each packet must be ≤ 1024 bytes (or the RUDP path's payload)
+        if (out != buf) sans_send_buf(sock, out, (int)r);
+        else sans_send_pkt(sock, buf, (int)r);
+        if (r < want) break; // EOF
     }
     fclose(fp);
 
@@ -1,10 +1,138 @@
+#ifndef RUDP_H
+#define RUDP_H
+
 #define DAT 0
 #define SYN 1
 #define ACK 2
 #define FIN 4
+#define PRB 8   /* path MTU probe, answered with PRB|ACK */
+#define FEC 16  /* parity; an ACK|FEC acknowledges a packet rebuilt from it */
+#define STM 32  /* sequenced like DAT, but for one of the connection's streams */
+
+/*
+ * Payload every peer accepts and every path is assumed to carry.  The
+ * handshake can raise the limit up to RUDP_MSS_MAX, the most a UDP/IPv4
+ * datagram holds after our header.
+ */
+#define RUDP_MAX_PAYLOAD 1024
+#define RUDP_MSS_MAX 65499
 
+/*
+ * `window` is the sender's advertised receive window: how many packets
+ * past the cumulative ACK it can buffer.  It and `flags` occupy what used
+ * to be padding, so the header stays 8 bytes.
+ */
 typedef struct {
   char type;
+  unsigned char flags;
+  unsigned short window;
   int seqnum;
   char payload[];
 } rudp_packet_t;
+
+#define RUDP_PKT_SIZE (sizeof(rudp_packet_t) + RUDP_MAX_PAYLOAD)
+
+/* rudp_packet_t without its payload, for a header kept apart from the data */
+typedef struct {
+  char type;
+  unsigned char flags;
+  unsigned short window;
+  int seqnum;
+} rudp_header_t;
+
+/*
+ * With RUDP_HDR_CRC in `flags` the datagram ends in RUDP_CRC_LEN bytes
+ * more: the CRC32C of everything before them, header included.  Once both
+ * ends have offered RUDP_SYN_CRC, every packet but the SYNs carries one.
+ */
+#define RUDP_HDR_CRC 1
+#define RUDP_CRC_LEN 4
+
+/*
+ * A DAT payload with RUDP_HDR_LZ is compressed (see rudp_lz.h).  Only
+ * sent once both ends have offered RUDP_SYN_LZ.
+ */
+#define RUDP_HDR_LZ 2
+
+/*
+ * SYN and SYN|ACK payload: the largest payload the sender will accept.
+ * Both sides use the smaller of the two; a handshake packet without it
+ * means RUDP_MAX_PAYLOAD, and one that ends there uses no fast open.
+ *
+ * Fast open: asked with RUDP_SYN_COOKIE_REQ, a server returns a cookie
+ * bound to the client's address in its SYN|ACK.  On a later connection the
+ * client sends it back with RUDP_SYN_DATA, and its first data packet
+ * (seqnum 0, at most RUDP_MAX_PAYLOAD bytes) follows the rudp_syn_t.  A
+ * server that takes it says so with RUDP_SYN_DATA_ACKED; otherwise the
+ * client sends it again once connected.
+ */
+#define RUDP_COOKIE_LEN 8
+
+typedef struct {
+  int mss;
+  int flags;
+  unsigned char cookie[RUDP_COOKIE_LEN];
+} rudp_syn_t;
+
+#define RUDP_SYN_COOKIE_REQ 1
+#define RUDP_SYN_COOKIE 2       /* `cookie` holds one */
+#define RUDP_SYN_DATA 4
+#define RUDP_SYN_DATA_ACKED 8
+#define RUDP_SYN_CRC 16         /* the sender can protect packets with CRC32C */
+#define RUDP_SYN_LZ 32          /* the sender can compress DAT payloads */
+
+typedef struct {
+  rudp_header_t hdr;
+  rudp_syn_t syn;
+} rudp_syn_packet_t;
+
+/*
+ * STM payload prefix.  `stream` is numbered by whichever end opened it,
+ * which sets RUDP_STM_OPENER on what it sends.  A packet carries the
+ * stream's packet `seq`, or its end with RUDP_STM_FIN; with
+ * RUDP_STM_CREDIT it carries nothing and lets the peer send up to `seq`.
+ */
+typedef struct {
+  unsigned short stream;
+  unsigned short flags;
+  int seq;
+} rudp_stm_t;
+
+#define RUDP_STM_FIN 1
+#define RUDP_STM_CREDIT 2
+#define RUDP_STM_OPENER 4
+
+/*
+ * FEC parity over a group of consecutive DAT packets: seqnum is the first
+ * of them and window how many there are.  The payload is the XOR of their
+ * lengths, each with RUDP_FEC_LZ if the packet was compressed, then the
+ * XOR of their payloads, each zero-padded to the longest, so a receiver
+ * missing any one of them can rebuild it.
+ */
+typedef struct {
+  int len_xor;
+  char parity[];
+} rudp_fec_t;
+
+#define RUDP_FEC_LZ (1 << 30)
+
+/*
+ * An ACK's seqnum is cumulative: every packet up to and including it has
+ * arrived.  Its payload says how long the receiver held the ACK back, so
+ * the sender can take that out of its RTT sample, followed by up to
+ * RUDP_SACK_MAX inclusive ranges of packets received beyond the cumulative
+ * point, the most recently extended one first.
+ */
+typedef struct {
+  int start;
+  int end;
+} rudp_sack_t;
+
+typedef struct {
+  int delay_us;
+  rudp_sack_t sacks[];
+} rudp_ack_t;
+
+#define RUDP_SACK_MAX 4
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef RUDP_CC_H
+#define RUDP_CC_H
+
+#ifndef RUDP_BBR_BW_ROUNDS
+#define RUDP_BBR_BW_ROUNDS 10
+#endif
+
+/*
+ * Congestion control.  An algorithm is a set of callbacks driven by the
+ * backend's ACK and retransmission-timeout events; all it does is move
+ * cwnd, the number of packets the sender may keep in the network.
+ */
+typedef struct rudp_cc rudp_cc_t;
+
+typedef struct {
+  const char* name;
+  void (*init)(rudp_cc_t* cc);
+  /* `delivered` packets newly acknowledged, `rtt_us` 0 if no valid sample */
+  void (*on_ack)(rudp_cc_t* cc, int delivered, long long rtt_us, long long now_us);
+  /* Loss found by fast retransmit, at most once per recovery episode */
+  void (*on_loss)(rudp_cc_t* cc, long long now_us);
+  void (*on_timeout)(rudp_cc_t* cc, long long now_us);
+  /* Packets per second to pace at; NULL paces cwnd over the smoothed RTT */
+  double (*pacing_rate)(const rudp_cc_t* cc, long long srtt_us);
+} rudp_cc_ops_t;
+
+struct rudp_cc {
+  const rudp_cc_ops_t* ops;
+  int algorithm;
+
+  double cwnd;
+  double ssthresh;
+  double max_cwnd;
+
+  unsigned long delivered;
+  long long min_rtt_us;
+  long long min_rtt_stamp_us;
+
+  union {
+    struct {
+      double w_max;
+      double w_est;
+      double origin;
+      double k;
+      long long epoch_us;
+    } cubic;
+
+    struct {
+      int mode;
+      int cycle;
+      double bw;   /* packets per second, max over the last rounds */
+      double bw_rounds[RUDP_BBR_BW_ROUNDS];
+      unsigned int round;
+      long long round_start_us;
+      unsigned long round_delivered;
+      double full_bw;
+      int full_bw_rounds;
+    } bbr;
+  } u;
+};
+
+int rudp_cc_init(rudp_cc_t* cc, int algorithm, unsigned int max_cwnd);
+int rudp_cc_select(rudp_cc_t* cc, int algorithm);
+void rudp_cc_on_ack(rudp_cc_t* cc, int delivered, long long rtt_us, long long now_us);
+void rudp_cc_on_loss(rudp_cc_t* cc, long long now_us);
+void rudp_cc_on_timeout(rudp_cc_t* cc, long long now_us);
+int rudp_cc_window(const rudp_cc_t* cc);
+double rudp_cc_pacing_rate(const rudp_cc_t* cc, long long srtt_us);
+
+#endif
@@ -0,0 +1,228 @@
+#ifndef RUDP_CONN_H
+#define RUDP_CONN_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include "rudp.h"
+#include "rudp_cc.h"
+#include "sans.h"
+
+#ifndef RUDP_CONN_CAP
+#define RUDP_CONN_CAP 1024
+#endif
+
+/* Receive buffer slots per connection, which bound the advertised window */
+#ifndef RUDP_RWND_SIZE
+#define RUDP_RWND_SIZE 64
+#endif
+
+/* Streams open at once per connection, and packets each may have unread */
+#ifndef RUDP_STREAMS_MAX
+#define RUDP_STREAMS_MAX 64
+#endif
+
+#ifndef RUDP_STREAM_WINDOW
+#define RUDP_STREAM_WINDOW 16
+#endif
+
+/* A queued datagram: its header, and the pool buffer holding its payload */
+typedef struct {
+  rudp_header_t hdr;
+  char* payload;
+  int packetlen;
+  int sacked;
+  int lost;
+  int retransmitted;
+  long long sent_us;
+  long long fec_us;    /* when the parity covering it went out, 0 if none */
+  uint32_t crc;        /* trailer, computed at the first send */
+} swnd_entry_t;
+
+/* A slot keeps its payload and seqnum after delivery until it is reused */
+typedef struct {
+  int seqnum;
+  int len;
+  int valid;
+  int fin;     /* the peer's FIN: sans_recv_pkt reports end of stream here */
+  int streamed;   /* a STM packet, already copied to its stream */
+  int lz;         /* `data` is compressed */
+  char* data;
+} rq_entry_t;
+
+/*
+ * One stream of a connection.  Its handle is twice the wire number, plus
+ * one if the peer opened it.  Packets the application has not read yet sit
+ * in `bufs` by seq, and the peer may only send RUDP_STREAM_WINDOW ahead of
+ * what was read: the credit it was last granted.
+ */
+typedef struct {
+  int handle;        /* 0 if the entry is free */
+  int accepted;      /* handed out by sans_stream_accept, or opened here */
+  int send_seq;
+  int send_limit;    /* the peer's credit: the first seq it has no room for */
+  int send_closed;
+  int recv_seq;      /* next seq sans_stream_recv returns */
+  int recv_granted;  /* credit last sent to the peer */
+  int recv_closed;   /* sans_stream_recv has returned the FIN */
+  char* bufs;        /* RUDP_STREAM_WINDOW slots of mss bytes */
+  int lens[RUDP_STREAM_WINDOW];  /* -1 if empty */
+  char fins[RUDP_STREAM_WINDOW];
+  pthread_cond_t recv_cond;  /* the next packet is in; live as long as the connection */
+  pthread_cond_t send_cond;  /* more credit */
+} rudp_stream_t;
+
+/* Fixed set of MSS-sized buffers, handed out from a free stack */
+typedef struct {
+  char* slab;
+  char** free_stack;
+  int buf_size;
+  unsigned int size;
+  unsigned int nfree;
+} rudp_pool_t;
+
+typedef struct {
+  long long srtt_us;
+  long long rttvar_us;
+  long long rto_us;
+  int backoff;
+} rudp_rtt_t;
+
+typedef struct rudp_shard rudp_shard_t;
+
+/*
+ * Connection control block, one per RUDP socket.  `lock` guards the window
+ * bookkeeping shared between the application thread and the backend; the
+ * fields marked "backend" are only ever touched by the backend thread.
+ */
+typedef struct rudp_conn {
+  int socket;
+  rudp_shard_t* shard;   /* the backend thread that serves it */
+  int gso;               /* backend: the socket takes UDP_SEGMENT sends */
+  int gro;               /* the socket returns UDP_GRO coalesced reads */
+  struct sockaddr_storage peer;
+  socklen_t peerlen;
+  int mss;               /* largest payload either end accepts, from the handshake */
+  int plpmtu;            /* largest payload known to cross the path whole */
+  int fastopen;          /* seqnum 0 came with the peer's SYN */
+  int crc;               /* both ends agreed on CRC32C trailers */
+  int lz;                /* both ends agreed on compression */
+  char* lz_rx;           /* mss bytes to decompress into for a short read */
+  int pmtu_ceiling;      /* backend: smallest size not known to fail, capped at mss */
+  int probe_size;        /* backend: payload size of the probe out, 0 if none */
+  int probe_seq;         /* backend */
+  int probe_tries;       /* backend */
+  long long probe_us;    /* backend: next probe step, 0 before the first */
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_cond_t recv_cond;
+
+  /* Send side: send_seqnum is the seqnum of send_window[head] */
+  rudp_pool_t pool;
+  swnd_entry_t* send_window;
+  unsigned int swnd_size;
+  int send_seqnum;
+  int head;
+  int count;
+  int in_flight;         /* backend */
+  int nsacked;           /* backend */
+  int nlost;             /* backend: in flight, awaiting retransmission */
+  int peer_edge;         /* backend: first seqnum past the peer's receive window */
+  int dupacks;           /* backend */
+  int in_recovery;       /* backend: fast recovery until recover_seq is ACKed */
+  int recover_seq;       /* backend */
+  long long rack_us;     /* backend: latest send time of a delivered packet */
+  long long tlp_us;      /* backend: pending tail-loss probe, 0 if none */
+  int tlp_sent;          /* backend: one probe per flight until progress */
+  int pacing;            /* RUDP_OPT_PACING value */
+  double pace_tokens;    /* backend: bytes the token bucket holds */
+  long long pace_stamp_us;  /* backend: last refill */
+  long long pace_us;     /* backend: when the bucket can send again, 0 if not waiting */
+  long long persist_us;  /* backend: next zero-window probe, 0 if none */
+  int persist_backoff;   /* backend */
+  rudp_rtt_t rtt;        /* backend */
+  rudp_cc_t cc;
+
+  /*
+   * Receive side: recv_seqnum is the next in-order seqnum expected from the
+   * peer.  recv_queue is indexed by seqnum starting at rq_head, which holds
+   * seqnum (recv_seqnum - rq_count): the first rq_count slots wait for
+   * sans_recv_pkt, later `valid` slots arrived ahead of a gap.
+   */
+  int recv_seqnum;
+  rq_entry_t* recv_queue;
+  char* rq_bufs;
+  unsigned int rq_size;
+  int rq_head;
+  int rq_count;
+  int rwnd_closed;   /* the last ACK advertised a zero window */
+  int wnd_update;    /* space opened since; the backend should tell the peer */
+  int rq_ooo;        /* valid slots past recv_seqnum */
+  int reorder_max;   /* bound on rq_ooo */
+  int ack_every;
+  int ack_delay_us;
+  int peer_fin;           /* the peer's FIN is in order: it will send nothing more */
+  int ack_pending;        /* backend: in-order packets not yet ACKed */
+  long long ack_due_us;   /* backend: delayed ACK deadline, 0 if none */
+  long long ack_rx_us;    /* backend: arrival of the newest of those packets */
+
+  rudp_stream_t* streams;  /* RUDP_STREAMS_MAX, allocated on first use */
+  int stream_opened;       /* wire number of the last stream opened here */
+  int stream_peer_max;     /* and by the peer; lower ones it opened too */
+
+  /*
+   * Forward error correction.  The backend XORs each DAT into fec_tx as it
+   * is first sent and sends the parity once fec_group have gone out, or
+   * when the send queue runs dry.  fec_rx rebuilds the peer's packets.
+   */
+  int fec_mode;          /* RUDP_OPT_FEC value */
+  int fec_group;         /* backend */
+  char* fec_tx;          /* backend: parity packet under construction */
+  int fec_start;         /* backend: its first seqnum */
+  int fec_count;         /* backend */
+  int fec_len;           /* backend: longest payload in it */
+  int fec_sent;          /* backend: packets first sent this loss epoch */
+  int fec_lost;          /* backend: lost or rebuilt by the peer this epoch */
+  double loss_rate;      /* backend */
+  char* fec_rx;          /* backend */
+
+  rudp_stats_t stats;
+
+  int linger_ms;       /* RUDP_OPT_LINGER value */
+  int keepalive_ms;    /* RUDP_OPT_KEEPALIVE value */
+  int idle_timeout_ms; /* RUDP_OPT_IDLE_TIMEOUT value */
+  long long heard_us;  /* backend: latest datagram from the peer */
+  long long keepalive_us;  /* backend: latest keepalive sent, 0 if none */
+  int dead;            /* silent past the idle timeout; the buffers are gone */
+  int closed;
+  long long close_us;  /* once closed, the latest the backend frees the connection */
+  long long fin_rx_us; /* backend: arrival of the peer's latest FIN, 0 if none */
+  int queued;                  /* on the shard's ready list */
+  struct rudp_conn* ready_next;
+  struct rudp_conn* next;
+} rudp_conn_t;
+
+int rudp_conn_open(int sock, const struct sockaddr* sa, socklen_t slen, int peer_mss, int flags);
+int rudp_local_mss(void);
+int rudp_local_fastopen(void);
+int rudp_local_crc(void);
+int rudp_local_lz(void);
+int rudp_conn_syn_data(int sock, const char* buf, int len);
+int rudp_conn_syn_acked(int sock);
+int rudp_conn_close(int sock);
+rudp_conn_t* rudp_conn_get(int sock);
+
+int enqueue_packet(int sock, const char* buf, int len);
+char* loan_buffer(int sock);
+int enqueue_buffer(int sock, char* buf, int len);
+int release_buffer(int sock, char* buf);
+int dequeue_received(int sock, char* buf, int len);
+
+int stream_open(int sock);
+int stream_accept(int sock);
+int stream_send(int sock, int handle, const char* buf, int len);
+int stream_recv(int sock, int handle, char* buf, int len);
+int stream_close(int sock, int handle);
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef RUDP_CRC_H
+#define RUDP_CRC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC32C (Castagnoli), as in iSCSI and SCTP.  `crc` is the result for the
+ * bytes before `buf`, 0 to start, so a packet can be covered in pieces.
+ * The implementation is picked once, by rudp_crc_init() or the first call:
+ * the SSE4.2 or ARMv8 CRC instructions where the CPU has them, otherwise
+ * slicing-by-8 tables.
+ */
+uint32_t rudp_crc32c(uint32_t crc, const void* buf, size_t len);
+void rudp_crc_init(void);
+const char* rudp_crc_impl(void);
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef RUDP_LZ_H
+#define RUDP_LZ_H
+
+/*
+ * LZ compression of one packet at a time, in the LZ4 block format:
+ * sequences of a token, literals, a 16-bit back offset and a match
+ * length, with no dictionary carried between packets so each stands on
+ * its own when others are lost.
+ *
+ * rudp_lz_compress returns the compressed length, or 0 if it would not
+ * fit in `cap` bytes: a caller passes less than `len` and sends the data
+ * as it is on 0.  rudp_lz_decompress returns the original length, or -1
+ * for input that is malformed or expands past `cap`.
+ */
+int rudp_lz_compress(const char* src, int len, char* dst, int cap);
+int rudp_lz_decompress(const char* src, int len, char* dst, int cap);
+
+#endif
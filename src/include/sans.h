@@ -1,5 +1,92 @@
+#ifndef SANS_H
+#define SANS_H
+
 #define IPPROTO_RUDP 63
 
+#define RUDP_OPT_WINDOW 1
+#define RUDP_OPT_POOL   2
+#define RUDP_OPT_CC     3
+#define RUDP_OPT_ACK_EVERY 4   /* in-order packets per ACK; 1 ACKs each one */
+#define RUDP_OPT_ACK_DELAY 5   /* microseconds a partial ACK may be held */
+#define RUDP_OPT_REORDER   6   /* early packets held ahead of a gap */
+#define RUDP_OPT_PACING    7   /* bytes per second, or one of the below */
+#define RUDP_OPT_LINGER    8   /* milliseconds sans_disconnect waits for the peer's ACK */
+#define RUDP_OPT_SHARDS    9   /* backend threads; only before init_rudp_backend() */
+#define RUDP_OPT_MSS      10   /* largest payload offered in the handshake, 1024 to 65499 */
+#define RUDP_OPT_FEC      11   /* data packets per XOR parity packet, 0 for none */
+#define RUDP_OPT_FASTOPEN 12   /* 1 (the default) takes data on SYNs with a valid cookie */
+#define RUDP_OPT_KEEPALIVE 13  /* milliseconds of silence before probing the peer, 0 for never */
+#define RUDP_OPT_IDLE_TIMEOUT 14  /* milliseconds of silence before giving the peer up, 0 for never */
+#define RUDP_OPT_CRC      15   /* 1 offers a CRC32C on every packet; used if the peer offers it too */
+#define RUDP_OPT_COMPRESS 16   /* 1 offers LZ compression of DAT payloads, likewise */
+
+#define RUDP_SHARDS_MAX 64
+
+#define RUDP_PACING_AUTO 0     /* pace cwnd over the RTT (the default) */
+#define RUDP_PACING_OFF  (-1)
+
+#define RUDP_FEC_MAX  32
+#define RUDP_FEC_AUTO (-1)     /* group size follows the measured loss rate */
+
+/* Congestion control algorithms for RUDP_OPT_CC */
+#define RUDP_CC_AIMD  0
+#define RUDP_CC_CUBIC 1
+#define RUDP_CC_BBR   2
+
+/* Per-connection counters, see rudp_get_stats() */
+typedef struct {
+  unsigned int pool_size;         /* packet buffers allocated with the connection */
+  unsigned int pool_in_use;
+  unsigned int pool_high_water;
+  unsigned long pool_exhausted;   /* sends that had to wait for a free buffer */
+  int cc_algorithm;
+  unsigned int cwnd;              /* packets */
+  unsigned int ssthresh;
+  unsigned long timeouts;         /* retransmission timer expirations */
+  unsigned int peer_window;       /* packets the peer can still accept */
+  unsigned long window_probes;    /* probes sent while the peer's window was zero */
+  unsigned long fast_retransmits; /* packets declared lost before their RTO */
+  unsigned long tail_probes;
+  unsigned long acks_sent;
+  unsigned long acks_delayed;     /* sent when the delayed-ACK timer fired */
+  unsigned long reorder_packets;  /* arrived ahead of a gap and were held */
+  unsigned long reorder_depth_total;  /* sum of their distances past the gap */
+  unsigned int reorder_depth_max;
+  unsigned int reorder_held;      /* held right now */
+  unsigned long reorder_dropped;  /* early packets refused, buffer bound reached */
+  unsigned long dup_packets;      /* data that had already arrived */
+  unsigned long pacing_rate;      /* bytes per second, 0 while unpaced */
+  unsigned long pacing_waits;     /* sends held back for tokens */
+  unsigned long pacing_late_us_total;  /* timer lateness over those waits */
+  unsigned long pacing_late_us_max;
+  unsigned long tx_packets;       /* datagrams and the syscalls that moved them */
+  unsigned long tx_syscalls;
+  unsigned long rx_packets;
+  unsigned long rx_syscalls;
+  unsigned int mss;               /* largest payload either end accepts */
+  unsigned int max_payload;       /* largest known to cross the path unfragmented */
+  unsigned long pmtu_probes;
+  unsigned long pmtu_black_holes; /* falls back to 1024 after repeated timeouts */
+  unsigned int fec_group;         /* data packets per parity packet now, 0 if off */
+  unsigned int loss_permille;     /* smoothed loss rate FEC_AUTO works from */
+  unsigned long fec_parity_sent;
+  unsigned long fec_peer_recovered;  /* our packets the peer rebuilt from parity */
+  unsigned long fec_recovered;    /* the peer's packets we rebuilt */
+  unsigned int streams_open;
+  unsigned int fastopen;          /* 1 if the first data packet rode on the SYN */
+  unsigned long keepalives_sent;
+  unsigned int dead;              /* the peer went silent; calls fail with ETIMEDOUT */
+  unsigned int crc;               /* 1 if packets carry a CRC32C */
+  unsigned long crc_errors;       /* datagrams dropped for a bad or missing CRC32C */
+  unsigned int compress;          /* 1 if payloads we send may be compressed */
+  unsigned long lz_bytes_in;      /* payload bytes offered for compression */
+  unsigned long lz_bytes_out;     /* what they took on the wire; in/out is the ratio */
+  unsigned long lz_packets;       /* sent compressed */
+  unsigned long lz_raw;           /* tried, but sent as they were for lack of gain */
+  unsigned long lz_ns;            /* time spent compressing */
+  unsigned long unlz_ns;          /* and decompressing what the peer sent */
+} rudp_stats_t;
+
 int http_client(const char* host, int port);
 int http_server(const char* iface, int port);
 int smtp_agent(const char* host, int port);
@@ -12,4 +99,56 @@ int sans_send_pkt(int socket, const char* buf, int len);
 int sans_recv_data(int socket, char* buf, int len);
 int sans_recv_pkt(int socket, char* buf, int len);
 int sans_disconnect(int socket);
-void* rudp_backend(void* unused);
+int init_rudp_backend(void);
+int rudp_configure(int option, int value);
+int rudp_setsockopt(int socket, int option, int value);
+int rudp_get_stats(int socket, rudp_stats_t* stats);
+int rudp_max_payload(int socket);
+int rudp_backend_shards(void);
+void* rudp_backend(void* shard);
+
+/*
+ * sans_connect_send connects and sends `buf` as the first packet.  Over
+ * RUDP, once an earlier connection to the same server has left a fast-open
+ * cookie, a packet of up to 1024 bytes goes with the SYN, so the request
+ * reaches the server and its answer can come back in one round trip.
+ */
+int sans_connect_send(const char* addr, int port, int protocol, const char* buf, int len);
+
+/*
+ * Connecting gives up with ETIMEDOUT once every address has let its SYN
+ * retries go unanswered; sans_connect_timeout also gives up after
+ * `timeout_ms` in all.
+ */
+int sans_connect_timeout(const char* addr, int port, int protocol, int timeout_ms);
+
+/*
+ * Zero-copy sends on RUDP sockets.  sans_get_buf lends out one of the
+ * socket's pool buffers, which hold the negotiated MSS; payloads up to
+ * rudp_max_payload() bytes go out without IP fragmentation.  Fill it and pass
+ * it to sans_send_buf, after which it belongs to the socket again and is
+ * recycled once the peer ACKs it (if the call fails, the caller still
+ * owns it).  sans_put_buf returns a buffer that will not be sent.  With
+ * RUDP_OPT_COMPRESS agreed, a payload is compressed into another buffer
+ * on the way, so that one copy is made after all.
+ */
+char* sans_get_buf(int socket);
+int sans_send_buf(int socket, char* buf, int len);
+int sans_put_buf(int socket, char* buf);
+
+/*
+ * Streams multiplexed over one RUDP connection, sharing its handshake,
+ * congestion control and retransmission.  Each is ordered on its own, so a
+ * loss only holds up the stream it hit.  sans_stream_open returns a new
+ * stream handle; the peer learns of it with its first packet and gets its
+ * own handle from sans_stream_accept (0 once the connection has ended).
+ * Packets are at most the MSS less 8 bytes.  sans_stream_recv returns 0
+ * at the stream's end, which the sender marks with sans_stream_close.
+ */
+int sans_stream_open(int socket);
+int sans_stream_accept(int socket);
+int sans_stream_send(int socket, int stream, const char* buf, int len);
+int sans_stream_recv(int socket, int stream, char* buf, int len);
+int sans_stream_close(int socket, int stream);
+
+#endif
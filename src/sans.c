@@ -1,6 +1,8 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
 #include <pthread.h>
 #include "include/sans.h"
 
@@ -79,17 +81,24 @@ int main(int argc, char** argv) {
   int port = strtol(argv[4], NULL, 0);
 
   { 
+    /* One backend shard per core */
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores > RUDP_SHARDS_MAX) cores = RUDP_SHARDS_MAX;
+    if (cores > 1) rudp_configure(RUDP_OPT_SHARDS, (int)cores);
+
     int init_rudp_backend(void);
     if (init_rudp_backend() != 0) {
       fprintf(stderr, "Error returned during rudp backend setup\n");
       exit(-2);
     }
 
-    pthread_t backend_thread;
-    int result = pthread_create(&backend_thread, NULL, rudp_backend, NULL);
-    if (result != 0) {
-      fprintf(stderr, "Failed to create background worker thread\n");
-      exit(-1);
+    for (int i = 0; i < rudp_backend_shards(); i++) {
+      pthread_t backend_thread;
+      int result = pthread_create(&backend_thread, NULL, rudp_backend, (void*)(intptr_t)i);
+      if (result != 0) {
+        fprintf(stderr, "Failed to create background worker thread\n");
+        exit(-1);
+      }
     }
   }
   
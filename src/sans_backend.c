@@ -1,143 +1,3541 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
 #include <pthread.h>
 #include <sys/socket.h>
-#include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <time.h>
 #include <unistd.h>
-#include "include/rudp.h"
+#include "include/rudp_conn.h"
+#include "include/rudp_crc.h"
+#include "include/rudp_lz.h"
+#include "include/sans.h"
 
-const unsigned int swnd_size = 1;
+#ifndef RUDP_SWND_SIZE
+#define RUDP_SWND_SIZE 32
+#endif
 
-typedef struct {
-  int socket;
-  int packetlen;
-  rudp_packet_t* packet;
-} swnd_entry_t;
+#ifndef RUDP_SWND_MAX
+#define RUDP_SWND_MAX 1024
+#endif
 
-swnd_entry_t* send_window;
+/* Retransmission timeout bounds, in microseconds (RFC 6298 with a lower floor) */
+#ifndef RUDP_RTO_INIT_US
+#define RUDP_RTO_INIT_US 100000
+#endif
 
-static pthread_mutex_t send_window_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t send_window_cond = PTHREAD_COND_INITIALIZER;
+#ifndef RUDP_RTO_MIN_US
+#define RUDP_RTO_MIN_US 5000
+#endif
 
-int send_seqnum = 0;
+#ifndef RUDP_RTO_MAX_US
+#define RUDP_RTO_MAX_US 60000000
+#endif
 
-int recv_seqnum = 0;
+/* Timer granularity term `G` from RFC 6298 */
+#define RUDP_CLOCK_G_US 1000
 
-static int count = 0;
-static int head = 0;
+/* SACKed packets (or duplicate ACKs) above a hole before it counts as lost */
+#ifndef RUDP_DUPTHRESH
+#define RUDP_DUPTHRESH 3
+#endif
 
-void enqueue_packet(int sock, const char* buf, int len) {
-  pthread_mutex_lock(&send_window_lock);
+/*
+ * Delayed ACKs: one ACK per RUDP_ACK_EVERY in-order packets, or after
+ * RUDP_ACK_DELAY_US for a partial batch.  The delay stays well under the
+ * minimum RTO so a held ACK never looks like a loss.
+ */
+#ifndef RUDP_ACK_EVERY
+#define RUDP_ACK_EVERY 2
+#endif
 
-  while (count >= (int)swnd_size) {
-    pthread_cond_wait(&send_window_cond, &send_window_lock);
+#ifndef RUDP_ACK_DELAY_US
+#define RUDP_ACK_DELAY_US 1000
+#endif
+
+#define RUDP_ACK_DELAY_MAX_US (RUDP_RTO_MIN_US / 2)
+
+/*
+ * Pacing token bucket: it holds RUDP_PACING_QUANTUM_US worth of the rate,
+ * but never less than RUDP_PACING_BURST full packets.
+ */
+#ifndef RUDP_PACING_QUANTUM_US
+#define RUDP_PACING_QUANTUM_US 1000
+#endif
+
+#ifndef RUDP_PACING_BURST
+#define RUDP_PACING_BURST 2
+#endif
+
+/* How long sans_disconnect waits for the peer to acknowledge everything */
+#ifndef RUDP_LINGER_MS
+#define RUDP_LINGER_MS 2000
+#endif
+
+/*
+ * How long a closed connection keeps answering the peer's retransmitted
+ * FIN.  The peer may have no RTT sample yet, so this covers a few backoffs
+ * from RUDP_RTO_INIT_US rather than our own RTO.
+ */
+#ifndef RUDP_TIME_WAIT_US
+#define RUDP_TIME_WAIT_US 1000000
+#endif
+
+/*
+ * Liveness.  After RUDP_KEEPALIVE_MS without a datagram from the peer a
+ * connection sends a keepalive, an empty PRB the peer echoes, and repeats
+ * it as long as the silence lasts; after RUDP_IDLE_TIMEOUT_MS it gives the
+ * peer up for dead.
+ */
+#ifndef RUDP_KEEPALIVE_MS
+#define RUDP_KEEPALIVE_MS 5000
+#endif
+
+#ifndef RUDP_IDLE_TIMEOUT_MS
+#define RUDP_IDLE_TIMEOUT_MS 30000
+#endif
+
+/*
+ * Compression.  Payloads shorter than RUDP_LZ_MIN are sent as they are,
+ * and so are those it would not shrink by a sixteenth.
+ */
+#ifndef RUDP_LZ_MIN
+#define RUDP_LZ_MIN 64
+#endif
+
+/* Retry delay when the kernel refuses a datagram (e.g. ENOBUFS) */
+#define RUDP_SEND_RETRY_US 1000
+
+#define RUDP_MAX_EVENTS 64
+
+/* Backend threads, each serving its own share of the connections */
+#ifndef RUDP_SHARDS
+#define RUDP_SHARDS 1
+#endif
+
+/* Datagrams moved per sendmmsg/recvmmsg call */
+#ifndef RUDP_BATCH
+#define RUDP_BATCH 32
+#endif
+
+/*
+ * UDP GSO/GRO.  A GSO send carries at most RUDP_GSO_SEGS datagrams in one
+ * buffer the kernel splits up, and a GRO read returns up to RUDP_GRO_BUF
+ * bytes of datagrams it coalesced.  Each shard reads into RUDP_RX_BYTES.
+ */
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+#ifndef RUDP_GSO_SEGS
+#define RUDP_GSO_SEGS 64
+#endif
+
+#define RUDP_GSO_BYTES 65000
+#define RUDP_GRO_BUF 65536
+#define RUDP_RX_BYTES (4 * RUDP_GRO_BUF)
+
+/* Received packets are parsed in place, from addresses aligned to this */
+#define RUDP_RX_ALIGN ((int)_Alignof(rudp_packet_t))
+
+#define RUDP_ACK_MAX (sizeof(rudp_packet_t) + sizeof(rudp_ack_t) + RUDP_SACK_MAX * sizeof(rudp_sack_t) + RUDP_CRC_LEN)
+
+/*
+ * Largest payload this end accepts, offered in the handshake.  The default
+ * fits a 9000-byte jumbo frame; loopback takes up to RUDP_MSS_MAX.
+ */
+#ifndef RUDP_MSS
+#define RUDP_MSS 8192
+#endif
+
+/*
+ * Datagram packetization layer PMTU discovery (RFC 8899).  Every connection
+ * starts at RUDP_MAX_PAYLOAD and probes upward to the negotiated MSS with
+ * padded PRB packets sent with fragmentation forbidden; a size is given up
+ * after RUDP_PMTU_PROBES unanswered probes.  The search stops when it has
+ * narrowed to RUDP_PMTU_STEP bytes and is repeated every RUDP_PMTU_RAISE_US
+ * in case the path changed.  RUDP_PMTU_BLACK_HOLE back-to-back timeouts
+ * drop the connection to the base size.
+ */
+#define RUDP_PMTU_PROBES 3
+#define RUDP_PMTU_STEP 32
+#define RUDP_PMTU_RAISE_US 600000000LL
+#define RUDP_PMTU_BLACK_HOLE 3
+
+/*
+ * FEC_AUTO re-estimates the loss rate every RUDP_FEC_EPOCH packets.  Below
+ * RUDP_FEC_MIN_LOSS it sends no parity; above, it sizes groups so that on
+ * average RUDP_FEC_TARGET packets of a group (parity included) are lost,
+ * keeping two losses in one group, which XOR can't repair, uncommon.
+ */
+#define RUDP_FEC_EPOCH 256
+#define RUDP_FEC_MIN_LOSS 0.005
+#define RUDP_FEC_TARGET 0.15
+
+/* Window size given to newly opened connections */
+unsigned int swnd_size = RUDP_SWND_SIZE;
+
+/* Packet buffers preallocated per connection; 0 sizes the pool to the window */
+unsigned int pool_size = 0;
+
+/* Congestion control given to newly opened connections */
+int cc_algorithm = RUDP_CC_CUBIC;
+
+/* ACK coalescing given to newly opened connections */
+int ack_every = RUDP_ACK_EVERY;
+int ack_delay_us = RUDP_ACK_DELAY_US;
+
+/* Early packets a new connection holds ahead of a gap */
+int reorder_max = RUDP_RWND_SIZE;
+
+/* Pacing given to newly opened connections */
+int pacing = RUDP_PACING_AUTO;
+
+/* Linger time given to newly opened connections */
+int linger_ms = RUDP_LINGER_MS;
+
+/* Backend shards to create; fixed once the backend is set up */
+int shard_count = RUDP_SHARDS;
+
+/* Largest payload offered in new handshakes */
+int mss_local = RUDP_MSS;
+
+/* Forward error correction given to newly opened connections */
+int fec_mode = 0;
+
+/* Whether sans_accept takes data that comes with a SYN */
+int fastopen = 1;
+
+/* Whether handshakes offer CRC32C trailers */
+int crc_local = 0;
+
+/* Whether handshakes offer compression */
+int lz_local = 0;
+
+/* Liveness checks given to newly opened connections */
+int keepalive_ms = RUDP_KEEPALIVE_MS;
+int idle_timeout_ms = RUDP_IDLE_TIMEOUT_MS;
+
+/*
+ * Connections are indexed by socket for O(1) lookup from the application
+ * side.  `conns_lock` guards the table and the configuration above and is
+ * only taken to open and close connections.
+ */
+static rudp_conn_t* conn_table[RUDP_CONN_CAP];
+static pthread_mutex_t conns_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * A backend thread and everything it polls.  Each connection belongs to one
+ * shard for its whole life, so nothing on the packet path is shared between
+ * shards.  `conns` is the list the shard walks when its timer fires; its
+ * lock is only taken to add and remove connections and for that walk.
+ *
+ * Connections with work for the backend (new packets queued, or closed) are
+ * pushed onto the shard's ready list; the eventfd is only written when the
+ * list goes from empty to non-empty.
+ */
+struct rudp_shard {
+  int epoll_fd;
+  int wake_fd;
+  int timer_fd;
+  long long timer_armed_us;  /* backend */
+  int running;
+
+  rudp_conn_t* conns;
+  pthread_mutex_t conns_lock;
+
+  rudp_conn_t* ready_list;
+  pthread_mutex_t ready_lock;
+
+  char* rx_bufs;  /* backend: RUDP_RX_BYTES for recvmmsg */
+  char* rx_align;  /* backend: RUDP_GRO_BUF to parse a misaligned GRO segment from */
+};
+
+static rudp_shard_t shards[RUDP_SHARDS_MAX];
+
+static pthread_once_t backend_once = PTHREAD_ONCE_INIT;
+static int backend_status = -1;
+static int backend_started = 0;
+
+static long long now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static long long clamp_rto(long long rto_us) {
+  if (rto_us < RUDP_RTO_MIN_US) return RUDP_RTO_MIN_US;
+  if (rto_us > RUDP_RTO_MAX_US) return RUDP_RTO_MAX_US;
+  return rto_us;
+}
+
+/* Recomputes the RTO from SRTT/RTTVAR, dropping any timer backoff */
+static void rtt_reset_backoff(rudp_rtt_t* r) {
+  r->backoff = 0;
+  if (r->srtt_us == 0) {
+    return;
+  }
+
+  long long var_term = 4 * r->rttvar_us;
+  if (var_term < RUDP_CLOCK_G_US) var_term = RUDP_CLOCK_G_US;
+
+  r->rto_us = clamp_rto(r->srtt_us + var_term);
+}
+
+/* Folds a new round-trip sample into SRTT/RTTVAR and recomputes the RTO */
+static void rtt_sample(rudp_rtt_t* r, long long sample_us) {
+  if (sample_us < 0) {
+    return;
+  }
+
+  if (r->srtt_us == 0) {
+    r->srtt_us = sample_us;
+    r->rttvar_us = sample_us / 2;
+  } else {
+    long long err = r->srtt_us - sample_us;
+    if (err < 0) err = -err;
+    r->rttvar_us = (3 * r->rttvar_us + err) / 4;
+    r->srtt_us = (7 * r->srtt_us + sample_us) / 8;
+  }
+
+  rtt_reset_backoff(r);
+}
+
+/* Exponential backoff after a retransmission timeout */
+static void rtt_backoff(rudp_rtt_t* r) {
+  r->backoff = r->backoff + 1;
+  r->rto_us = clamp_rto(r->rto_us * 2);
+}
+
+static int fec_option_valid(int value) {
+  return value == RUDP_FEC_AUTO || (value >= 0 && value <= RUDP_FEC_MAX);
+}
+
+static int recv_option_valid(int option, int value) {
+  if (option == RUDP_OPT_ACK_EVERY) {
+    return value >= 1 && value <= RUDP_RWND_SIZE;
+  }
+  if (option == RUDP_OPT_REORDER) {
+    return value >= 0 && value <= RUDP_RWND_SIZE;
+  }
+  return value >= 0 && value <= RUDP_ACK_DELAY_MAX_US;
+}
+
+int rudp_configure(int option, int value) {
+  if (option == RUDP_OPT_WINDOW) {
+    if (value < 1 || value > RUDP_SWND_MAX) {
+      errno = EINVAL;
+      return -1;
+    }
+    pthread_mutex_lock(&conns_lock);
+    swnd_size = (unsigned int)value;
+    pthread_mutex_unlock(&conns_lock);
+    return 0;
+  }
+
+  if (option == RUDP_OPT_POOL) {
+    if (value < 0 || value > RUDP_SWND_MAX) {
+      errno = EINVAL;
+      return -1;
+    }
+    pthread_mutex_lock(&conns_lock);
+    pool_size = (unsigned int)value;
+    pthread_mutex_unlock(&conns_lock);
+    return 0;
+  }
+
+  if (option == RUDP_OPT_CC) {
+    if (value < RUDP_CC_AIMD || value > RUDP_CC_BBR) {
+      errno = EINVAL;
+      return -1;
+    }
+    pthread_mutex_lock(&conns_lock);
+    cc_algorithm = value;
+    pthread_mutex_unlock(&conns_lock);
+    return 0;
+  }
+
+  if (option == RUDP_OPT_PACING) {
+    if (value < RUDP_PACING_OFF) {
+      errno = EINVAL;
+      return -1;
+    }
+    pthread_mutex_lock(&conns_lock);
+    pacing = value;
+    pthread_mutex_unlock(&conns_lock);
+    return 0;
+  }
+
+  if (option == RUDP_OPT_LINGER) {
+    if (value < 0) {
+      errno = EINVAL;
+      return -1;
+    }
+    pthread_mutex_lock(&conns_lock);
+    linger_ms = value;
+    pthread_mutex_unlock(&conns_lock);
+    return 0;
+  }
+
+  if (option == RUDP_OPT_FEC) {
+    if (fec_option_valid(value) == 0) {
+      errno = EINVAL;
+      return -1;
+    }
+    pthread_mutex_lock(&conns_lock);
+    fec_mode = value;
+    pthread_mutex_unlock(&conns_lock);
+    return 0;
+  }
+
+  if (option == RUDP_OPT_MSS) {
+    if (value < RUDP_MAX_PAYLOAD || value > RUDP_MSS_MAX) {
+      errno = EINVAL;
+      return -1;
+    }
+    pthread_mutex_lock(&conns_lock);
+    mss_local = value;
+    pthread_mutex_unlock(&conns_lock);
+    return 0;
+  }
+
+  if (option == RUDP_OPT_KEEPALIVE || option == RUDP_OPT_IDLE_TIMEOUT) {
+    if (value < 0) {
+      errno = EINVAL;
+      return -1;
+    }
+    pthread_mutex_lock(&conns_lock);
+    if (option == RUDP_OPT_KEEPALIVE) {
+      keepalive_ms = value;
+    } else {
+      idle_timeout_ms = value;
+    }
+    pthread_mutex_unlock(&conns_lock);
+    return 0;
+  }
+
+  if (option == RUDP_OPT_FASTOPEN) {
+    if (value != 0 && value != 1) {
+      errno = EINVAL;
+      return -1;
+    }
+    pthread_mutex_lock(&conns_lock);
+    fastopen = value;
+    pthread_mutex_unlock(&conns_lock);
+    return 0;
+  }
+
+  if (option == RUDP_OPT_CRC) {
+    if (value != 0 && value != 1) {
+      errno = EINVAL;
+      return -1;
+    }
+    pthread_mutex_lock(&conns_lock);
+    crc_local = value;
+    pthread_mutex_unlock(&conns_lock);
+    return 0;
+  }
+
+  if (option == RUDP_OPT_COMPRESS) {
+    if (value != 0 && value != 1) {
+      errno = EINVAL;
+      return -1;
+    }
+    pthread_mutex_lock(&conns_lock);
+    lz_local = value;
+    pthread_mutex_unlock(&conns_lock);
+    return 0;
+  }
+
+  /* The shards are created with the backend, so this must come first */
+  if (option == RUDP_OPT_SHARDS) {
+    if (value < 1 || value > RUDP_SHARDS_MAX) {
+      errno = EINVAL;
+      return -1;
+    }
+    pthread_mutex_lock(&conns_lock);
+    int started = backend_started;
+    if (started == 0) {
+      shard_count = value;
+    }
+    pthread_mutex_unlock(&conns_lock);
+    if (started) {
+      errno = EBUSY;
+      return -1;
+    }
+    return 0;
+  }
+
+  if (option == RUDP_OPT_ACK_EVERY || option == RUDP_OPT_ACK_DELAY ||
+      option == RUDP_OPT_REORDER) {
+    if (recv_option_valid(option, value) == 0) {
+      errno = EINVAL;
+      return -1;
+    }
+    pthread_mutex_lock(&conns_lock);
+    if (option == RUDP_OPT_ACK_EVERY) {
+      ack_every = value;
+    } else if (option == RUDP_OPT_ACK_DELAY) {
+      ack_delay_us = value;
+    } else {
+      reorder_max = value;
+    }
+    pthread_mutex_unlock(&conns_lock);
+    return 0;
+  }
+
+  errno = ENOPROTOOPT;
+  return -1;
+}
+
+/* Per-connection counterpart of rudp_configure() for options that allow it */
+int rudp_setsockopt(int sock, int option, int value) {
+  rudp_conn_t* conn = rudp_conn_get(sock);
+  if (conn == NULL) {
+    errno = ENOTCONN;
+    return -1;
+  }
+
+  if (option == RUDP_OPT_CC) {
+    pthread_mutex_lock(&conn->lock);
+    int ret = rudp_cc_select(&conn->cc, value);
+    pthread_mutex_unlock(&conn->lock);
+    return ret;
+  }
+
+  if (option == RUDP_OPT_PACING) {
+    if (value < RUDP_PACING_OFF) {
+      errno = EINVAL;
+      return -1;
+    }
+    pthread_mutex_lock(&conn->lock);
+    conn->pacing = value;
+    pthread_mutex_unlock(&conn->lock);
+    return 0;
+  }
+
+  if (option == RUDP_OPT_LINGER) {
+    if (value < 0) {
+      errno = EINVAL;
+      return -1;
+    }
+    pthread_mutex_lock(&conn->lock);
+    conn->linger_ms = value;
+    pthread_mutex_unlock(&conn->lock);
+    return 0;
+  }
+
+  if (option == RUDP_OPT_FEC) {
+    if (fec_option_valid(value) == 0) {
+      errno = EINVAL;
+      return -1;
+    }
+    pthread_mutex_lock(&conn->lock);
+    conn->fec_mode = value;
+    pthread_mutex_unlock(&conn->lock);
+    return 0;
+  }
+
+  /* Takes effect at the backend's next timer, at most the old interval away */
+  if (option == RUDP_OPT_KEEPALIVE || option == RUDP_OPT_IDLE_TIMEOUT) {
+    if (value < 0) {
+      errno = EINVAL;
+      return -1;
+    }
+    pthread_mutex_lock(&conn->lock);
+    if (option == RUDP_OPT_KEEPALIVE) {
+      conn->keepalive_ms = value;
+    } else {
+      conn->idle_timeout_ms = value;
+    }
+    pthread_mutex_unlock(&conn->lock);
+    return 0;
+  }
+
+  if (option == RUDP_OPT_ACK_EVERY || option == RUDP_OPT_ACK_DELAY ||
+      option == RUDP_OPT_REORDER) {
+    if (recv_option_valid(option, value) == 0) {
+      errno = EINVAL;
+      return -1;
+    }
+    pthread_mutex_lock(&conn->lock);
+    if (option == RUDP_OPT_ACK_EVERY) {
+      conn->ack_every = value;
+    } else if (option == RUDP_OPT_ACK_DELAY) {
+      conn->ack_delay_us = value;
+    } else {
+      conn->reorder_max = value;
+    }
+    pthread_mutex_unlock(&conn->lock);
+    return 0;
+  }
+
+  errno = ENOPROTOOPT;
+  return -1;
+}
+
+/* The MSS handshake packets offer; see rudp_conn_open() */
+int rudp_local_mss(void) {
+  pthread_mutex_lock(&conns_lock);
+  int mss = mss_local;
+  pthread_mutex_unlock(&conns_lock);
+  return mss;
+}
+
+/* Whether sans_accept issues fast-open cookies and takes data on SYNs */
+int rudp_local_fastopen(void) {
+  pthread_mutex_lock(&conns_lock);
+  int enabled = fastopen;
+  pthread_mutex_unlock(&conns_lock);
+  return enabled;
+}
+
+/* Whether handshakes offer RUDP_SYN_CRC */
+int rudp_local_crc(void) {
+  pthread_mutex_lock(&conns_lock);
+  int enabled = crc_local;
+  pthread_mutex_unlock(&conns_lock);
+  return enabled;
+}
+
+/* Whether handshakes offer RUDP_SYN_LZ */
+int rudp_local_lz(void) {
+  pthread_mutex_lock(&conns_lock);
+  int enabled = lz_local;
+  pthread_mutex_unlock(&conns_lock);
+  return enabled;
+}
+
+static int pool_init(rudp_pool_t* pool, unsigned int size, int buf_size) {
+  pool->slab = malloc((size_t)size * buf_size);
+  pool->free_stack = malloc(size * sizeof(char*));
+  if (pool->slab == NULL || pool->free_stack == NULL) {
+    return -1;
+  }
+
+  for (unsigned int i = 0; i < size; i++) {
+    pool->free_stack[i] = pool->slab + (size_t)(size - 1 - i) * buf_size;
+  }
+  pool->buf_size = buf_size;
+  pool->size = size;
+  pool->nfree = size;
+  return 0;
+}
+
+static void pool_destroy(rudp_pool_t* pool) {
+  free(pool->slab);
+  free(pool->free_stack);
+}
+
+/* Caller holds conn->lock; NULL when every buffer is in use */
+static char* pool_get(rudp_conn_t* conn) {
+  rudp_pool_t* pool = &conn->pool;
+  if (pool->nfree == 0) {
+    return NULL;
+  }
+
+  pool->nfree = pool->nfree - 1;
+  unsigned int in_use = pool->size - pool->nfree;
+  if (in_use > conn->stats.pool_high_water) {
+    conn->stats.pool_high_water = in_use;
+  }
+  return pool->free_stack[pool->nfree];
+}
+
+/* Caller holds conn->lock */
+static void pool_put(rudp_conn_t* conn, char* buf) {
+  rudp_pool_t* pool = &conn->pool;
+  pool->free_stack[pool->nfree] = buf;
+  pool->nfree = pool->nfree + 1;
+}
+
+/* Whether `buf` is the start of one of the pool's buffers */
+static int pool_owns(rudp_pool_t* pool, const char* buf) {
+  if (buf < pool->slab || buf >= pool->slab + (size_t)pool->size * pool->buf_size) {
+    return 0;
+  }
+  return (buf - pool->slab) % pool->buf_size == 0;
+}
+
+/* Hands a connection to its shard's backend thread */
+static void conn_kick(rudp_conn_t* conn) {
+  rudp_shard_t* shard = conn->shard;
+  int wake = 0;
+
+  pthread_mutex_lock(&shard->ready_lock);
+  if (conn->queued == 0) {
+    conn->queued = 1;
+    wake = (shard->ready_list == NULL);
+    conn->ready_next = shard->ready_list;
+    shard->ready_list = conn;
+  }
+  pthread_mutex_unlock(&shard->ready_lock);
+
+  if (wake) {
+    uint64_t one = 1;
+    (void)write(shard->wake_fd, &one, sizeof(one));
+  }
+}
+
+/* Backend only: moves the shard's timerfd earlier if `deadline_us` precedes it */
+static void arm_timer(rudp_shard_t* shard, long long deadline_us) {
+  if (shard->timer_armed_us != 0 && shard->timer_armed_us <= deadline_us) {
+    return;
+  }
+
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = deadline_us / 1000000;
+  its.it_value.tv_nsec = (deadline_us % 1000000) * 1000;
+  if (timerfd_settime(shard->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) == 0) {
+    shard->timer_armed_us = deadline_us;
+  }
+}
+
+rudp_conn_t* rudp_conn_get(int sock) {
+  if (sock < 0 || sock >= RUDP_CONN_CAP) {
+    return NULL;
+  }
+  return __atomic_load_n(&conn_table[sock], __ATOMIC_ACQUIRE);
+}
+
+/* Waiters wake, find the handle gone and give up */
+static void stream_free(rudp_stream_t* st) {
+  free(st->bufs);
+  st->bufs = NULL;
+  st->handle = 0;
+  pthread_cond_broadcast(&st->recv_cond);
+  pthread_cond_broadcast(&st->send_cond);
+}
+
+static void conn_free(rudp_conn_t* conn) {
+  if (conn->streams != NULL) {
+    for (int i = 0; i < RUDP_STREAMS_MAX; i++) {
+      free(conn->streams[i].bufs);
+      pthread_cond_destroy(&conn->streams[i].recv_cond);
+      pthread_cond_destroy(&conn->streams[i].send_cond);
+    }
+    free(conn->streams);
+  }
+  pool_destroy(&conn->pool);
+  free(conn->send_window);
+  free(conn->recv_queue);
+  free(conn->rq_bufs);
+  free(conn->fec_tx);
+  free(conn->fec_rx);
+  free(conn->lz_rx);
+  pthread_mutex_destroy(&conn->lock);
+  pthread_cond_destroy(&conn->cond);
+  pthread_cond_destroy(&conn->recv_cond);
+  free(conn);
+}
+
+/* The backend checks this without conn->lock; close_us is set before it */
+static int conn_closed(rudp_conn_t* conn) {
+  return __atomic_load_n(&conn->closed, __ATOMIC_ACQUIRE);
+}
+
+/* Takes the connection off its shard's timer list */
+static void conn_unlink(rudp_conn_t* conn) {
+  rudp_shard_t* shard = conn->shard;
+
+  pthread_mutex_lock(&shard->conns_lock);
+  rudp_conn_t** link = &shard->conns;
+  while (*link != NULL && *link != conn) {
+    link = &(*link)->next;
+  }
+  if (*link != NULL) {
+    *link = conn->next;
+  }
+  pthread_mutex_unlock(&shard->conns_lock);
+}
+
+/*
+ * Starts serving a handshaken socket.  `peer_mss` is what the peer's SYN or
+ * SYN|ACK offered (0 if it offered nothing); both ends settle on the smaller
+ * of the two offers.  `flags` holds the RUDP_SYN_CRC and RUDP_SYN_LZ both
+ * ends offered.  With RUDP_SYN_CRC every packet carries a CRC32C trailer,
+ * and the backend drops any that arrive without one; with RUDP_SYN_LZ
+ * enqueue_packet may compress.
+ */
+int rudp_conn_open(int sock, const struct sockaddr* sa, socklen_t slen, int peer_mss, int flags) {
+  if (init_rudp_backend() != 0) {
+    return -1;
+  }
+  if (sock < 0 || sock >= RUDP_CONN_CAP) {
+    errno = EMFILE;
+    return -1;
+  }
+  if (sa == NULL || slen > (socklen_t)sizeof(struct sockaddr_storage)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  rudp_conn_t* conn = calloc(1, sizeof(rudp_conn_t));
+  if (conn == NULL) {
+    return -1;
+  }
+
+  conn->mss = rudp_local_mss();
+  if (peer_mss < conn->mss) {
+    conn->mss = (peer_mss < RUDP_MAX_PAYLOAD) ? RUDP_MAX_PAYLOAD : peer_mss;
+  }
+  if (flags & RUDP_SYN_CRC) {
+    conn->crc = 1;
+    conn->stats.crc = 1;
+    /* The trailer must still fit a UDP datagram */
+    if (conn->mss > RUDP_MSS_MAX - RUDP_CRC_LEN) {
+      conn->mss = RUDP_MSS_MAX - RUDP_CRC_LEN;
+    }
+  }
+  if (flags & RUDP_SYN_LZ) {
+    conn->lz = 1;
+    conn->stats.compress = 1;
+  }
+  conn->plpmtu = RUDP_MAX_PAYLOAD;
+  conn->pmtu_ceiling = conn->mss;
+
+  conn->socket = sock;
+  /* Descriptors are handed out lowest-first, so this spreads them evenly */
+  conn->shard = &shards[sock % shard_count];
+  memcpy(&conn->peer, sa, slen);
+  conn->peerlen = slen;
+  conn->rtt.rto_us = RUDP_RTO_INIT_US;
+  /* Until the first ACK says otherwise, assume the peer buffers what we do */
+  conn->peer_edge = RUDP_RWND_SIZE;
+  pthread_mutex_init(&conn->lock, NULL);
+  /* rudp_conn_close() waits on `cond` against a monotonic deadline */
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&conn->cond, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_cond_init(&conn->recv_cond, NULL);
+
+  conn->rq_size = RUDP_RWND_SIZE;
+  conn->recv_queue = calloc(conn->rq_size, sizeof(rq_entry_t));
+  conn->rq_bufs = malloc((size_t)conn->rq_size * conn->mss);
+  if (conn->recv_queue == NULL || conn->rq_bufs == NULL) {
+    conn_free(conn);
+    return -1;
+  }
+  for (unsigned int i = 0; i < conn->rq_size; i++) {
+    conn->recv_queue[i].data = conn->rq_bufs + (size_t)i * conn->mss;
+  }
+
+  pthread_mutex_lock(&conns_lock);
+  if (conn_table[sock] != NULL) {
+    pthread_mutex_unlock(&conns_lock);
+    conn_free(conn);
+    errno = EEXIST;
+    return -1;
+  }
+
+  conn->swnd_size = swnd_size;
+  rudp_cc_init(&conn->cc, cc_algorithm, conn->swnd_size);
+  conn->ack_every = ack_every;
+  conn->ack_delay_us = ack_delay_us;
+  conn->reorder_max = reorder_max;
+  conn->pacing = pacing;
+  conn->linger_ms = linger_ms;
+  conn->fec_mode = fec_mode;
+  conn->keepalive_ms = keepalive_ms;
+  conn->idle_timeout_ms = idle_timeout_ms;
+  conn->heard_us = now_us();
+  conn->send_window = calloc(conn->swnd_size, sizeof(swnd_entry_t));
+  if (conn->send_window == NULL ||
+      pool_init(&conn->pool, pool_size ? pool_size : conn->swnd_size, conn->mss) != 0) {
+    pthread_mutex_unlock(&conns_lock);
+    conn_free(conn);
+    return -1;
+  }
+
+  /* Segmentation offload where the kernel has it; send_batch drops it on EIO */
+  int zero = 0;
+  int one = 1;
+  conn->gso = setsockopt(sock, SOL_UDP, UDP_SEGMENT, &zero, sizeof(zero)) == 0;
+  conn->gro = setsockopt(sock, SOL_UDP, UDP_GRO, &one, sizeof(one)) == 0;
+
+  rudp_shard_t* shard = conn->shard;
+  pthread_mutex_lock(&shard->conns_lock);
+  conn->next = shard->conns;
+  shard->conns = conn;
+  pthread_mutex_unlock(&shard->conns_lock);
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = conn;
+  if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, sock, &ev) != 0) {
+    conn_unlink(conn);
+    pthread_mutex_unlock(&conns_lock);
+    conn_free(conn);
+    return -1;
+  }
+
+  __atomic_store_n(&conn_table[sock], conn, __ATOMIC_RELEASE);
+
+  pthread_mutex_unlock(&conns_lock);
+
+  /* So the backend starts the liveness timer even if nothing is ever sent */
+  conn_kick(conn);
+  return 0;
+}
+
+/*
+ * Server side of fast open, right after rudp_conn_open(): `buf` came with
+ * the peer's SYN and is its seqnum 0.  The SYN|ACK acknowledges it.
+ */
+int rudp_conn_syn_data(int sock, const char* buf, int len) {
+  rudp_conn_t* conn = rudp_conn_get(sock);
+  if (conn == NULL) {
+    errno = ENOTCONN;
+    return -1;
+  }
+  if (len < 0 || len > conn->mss) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+
+  pthread_mutex_lock(&conn->lock);
+  if (conn->recv_seqnum != 0) {
+    pthread_mutex_unlock(&conn->lock);
+    errno = EALREADY;
+    return -1;
+  }
+  rq_entry_t* slot = &conn->recv_queue[conn->rq_head];
+  memcpy(slot->data, buf, len);
+  slot->seqnum = 0;
+  slot->len = len;
+  slot->lz = 0;
+  slot->valid = 1;
+  conn->recv_seqnum = 1;
+  conn->rq_count = 1;
+  conn->fastopen = 1;
+  conn->stats.fastopen = 1;
+  pthread_cond_broadcast(&conn->recv_cond);
+  pthread_mutex_unlock(&conn->lock);
+  return 0;
+}
+
+/* Client side: the peer's SYN|ACK says it took our seqnum 0 with the SYN */
+int rudp_conn_syn_acked(int sock) {
+  rudp_conn_t* conn = rudp_conn_get(sock);
+  if (conn == NULL) {
+    errno = ENOTCONN;
+    return -1;
+  }
+
+  pthread_mutex_lock(&conn->lock);
+  if (conn->send_seqnum != 0 || conn->count != 0) {
+    pthread_mutex_unlock(&conn->lock);
+    errno = EALREADY;
+    return -1;
+  }
+  conn->send_seqnum = 1;
+  conn->stats.fastopen = 1;
+  pthread_mutex_unlock(&conn->lock);
+  return 0;
+}
+
+/* Backend only: unlinks a closed connection and releases everything it owns */
+static void conn_reap(rudp_conn_t* conn) {
+  conn_unlink(conn);
+
+  epoll_ctl(conn->shard->epoll_fd, EPOLL_CTL_DEL, conn->socket, NULL);
+  close(conn->socket);
+  conn_free(conn);
+}
+
+/*
+ * Caller holds conn->lock and has waited for a window slot.  The entry
+ * takes over `payload`, a pool buffer (NULL for none), until it is ACKed.
+ */
+static void queue_packet(rudp_conn_t* conn, char type, char* payload, int len) {
+  int idx = (conn->head + conn->count) % conn->swnd_size;
+  swnd_entry_t* entry = &conn->send_window[idx];
+
+  memset(&entry->hdr, 0, sizeof(entry->hdr));
+  entry->hdr.type = type;
+  entry->hdr.seqnum = conn->send_seqnum + conn->count;
+  entry->payload = payload;
+
+  entry->packetlen = sizeof(rudp_header_t) + len;
+  entry->sacked = 0;
+  entry->lost = 0;
+  entry->retransmitted = 0;
+  entry->sent_us = 0;
+  entry->fec_us = 0;
+
+  conn->count = conn->count + 1;
+}
+
+static int window_full(rudp_conn_t* conn) {
+  return conn->count >= (int)conn->swnd_size;
+}
+
+/* Caller holds conn->lock.  -1 with ETIMEDOUT once the peer has been given up */
+static int conn_alive(rudp_conn_t* conn) {
+  if (conn->dead) {
+    errno = ETIMEDOUT;
+    return -1;
+  }
+  return 0;
+}
+
+/* Caller holds conn->lock.  Waits for a window slot */
+static int window_wait(rudp_conn_t* conn) {
+  while (window_full(conn) && conn->dead == 0) {
+    pthread_cond_wait(&conn->cond, &conn->lock);
+  }
+  return conn_alive(conn);
+}
+
+/* Caller holds conn->lock.  Waits for a pool buffer, counting the wait if the window had room */
+static char* pool_wait(rudp_conn_t* conn) {
+  int counted = 0;
+  while (conn->pool.nfree == 0 && conn->dead == 0) {
+    if (window_full(conn) == 0 && counted == 0) {
+      conn->stats.pool_exhausted = conn->stats.pool_exhausted + 1;
+      counted = 1;
+    }
+    pthread_cond_wait(&conn->cond, &conn->lock);
+  }
+  if (conn_alive(conn) != 0) {
+    return NULL;
+  }
+  return pool_get(conn);
+}
+
+/*
+ * Caller holds conn->lock and has waited for a window slot.  Compresses
+ * `len` bytes of `buf` into `payload`, a pool buffer, with the lock
+ * dropped so the backend is not held up, then queues the result (or a
+ * plain copy, if it did not shrink).  Returns `len`, or -1 if the
+ * connection died meanwhile and `payload` went back to the pool.
+ */
+static int queue_compressed(rudp_conn_t* conn, char* payload, const char* buf, int len) {
+  pthread_mutex_unlock(&conn->lock);
+  long long start = now_ns();
+  int packed = rudp_lz_compress(buf, len, payload, len - len / 16);
+  long long spent = now_ns() - start;
+  if (packed == 0) {
+    memcpy(payload, buf, len);
+  }
+  pthread_mutex_lock(&conn->lock);
+
+  /* Another sender may have taken the slot meanwhile */
+  if (window_wait(conn) != 0) {
+    pool_put(conn, payload);
+    return -1;
+  }
+  queue_packet(conn, DAT, payload, packed ? packed : len);
+  conn->stats.lz_bytes_in = conn->stats.lz_bytes_in + len;
+  conn->stats.lz_bytes_out = conn->stats.lz_bytes_out + (packed ? packed : len);
+  conn->stats.lz_ns = conn->stats.lz_ns + spent;
+  if (packed) {
+    conn->send_window[(conn->head + conn->count - 1) % conn->swnd_size].hdr.flags = RUDP_HDR_LZ;
+    conn->stats.lz_packets = conn->stats.lz_packets + 1;
+  } else {
+    conn->stats.lz_raw = conn->stats.lz_raw + 1;
+  }
+  return len;
+}
+
+/* Copies `buf` into a pool buffer and queues it */
+int enqueue_packet(int sock, const char* buf, int len) {
+  rudp_conn_t* conn = rudp_conn_get(sock);
+  if (conn == NULL) {
+    errno = ENOTCONN;
+    return -1;
+  }
+  if (len > conn->mss) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+
+  pthread_mutex_lock(&conn->lock);
+
+  char* payload = NULL;
+  if (window_wait(conn) == 0) {
+    payload = pool_wait(conn);
+  }
+  if (payload == NULL) {
+    pthread_mutex_unlock(&conn->lock);
+    return -1;
+  }
+  if (conn->lz == 0 || len < RUDP_LZ_MIN) {
+    memcpy(payload, buf, len);
+    queue_packet(conn, DAT, payload, len);
+    pthread_mutex_unlock(&conn->lock);
+
+    conn_kick(conn);
+    return len;
+  }
+
+  int queued = queue_compressed(conn, payload, buf, len);
+  pthread_mutex_unlock(&conn->lock);
+
+  if (queued > 0) {
+    conn_kick(conn);
+  }
+  return queued;
+}
+
+/*
+ * Lends the caller an MSS-sized pool buffer to build a payload
+ * in place, blocking until one is free.  The caller owns it until it hands
+ * it back with enqueue_buffer() or release_buffer().
+ */
+char* loan_buffer(int sock) {
+  rudp_conn_t* conn = rudp_conn_get(sock);
+  if (conn == NULL) {
+    errno = ENOTCONN;
+    return NULL;
+  }
+
+  pthread_mutex_lock(&conn->lock);
+  char* buf = pool_wait(conn);
+  pthread_mutex_unlock(&conn->lock);
+  return buf;
+}
+
+/*
+ * Queues `len` bytes of a loaned buffer without copying them.  Ownership
+ * passes back to the connection at once: the buffer returns to the pool
+ * when the peer ACKs it, and the caller must not touch it again.  With
+ * compression on, the payload is compressed into another free buffer
+ * instead and the loan goes straight back to the pool; if none is free it
+ * is sent as it is rather than waiting on one.
+ */
+int enqueue_buffer(int sock, char* buf, int len) {
+  rudp_conn_t* conn = rudp_conn_get(sock);
+  if (conn == NULL) {
+    errno = ENOTCONN;
+    return -1;
+  }
+  if (pool_owns(&conn->pool, buf) == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (len > conn->mss) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+
+  pthread_mutex_lock(&conn->lock);
+
+  if (window_wait(conn) != 0) {
+    pthread_mutex_unlock(&conn->lock);
+    return -1;
+  }
+
+  char* payload = NULL;
+  if (conn->lz && len >= RUDP_LZ_MIN) {
+    payload = pool_get(conn);
+  }
+  if (payload == NULL) {
+    queue_packet(conn, DAT, buf, len);
+    pthread_mutex_unlock(&conn->lock);
+
+    conn_kick(conn);
+    return len;
+  }
+
+  int queued = queue_compressed(conn, payload, buf, len);
+  if (queued > 0) {
+    pool_put(conn, buf);
+    pthread_cond_broadcast(&conn->cond);
+  }
+  pthread_mutex_unlock(&conn->lock);
+
+  if (queued > 0) {
+    conn_kick(conn);
+  }
+  return queued;
+}
+
+/* Gives back a loaned buffer that will not be sent */
+int release_buffer(int sock, char* buf) {
+  rudp_conn_t* conn = rudp_conn_get(sock);
+  if (conn == NULL) {
+    errno = ENOTCONN;
+    return -1;
+  }
+  if (pool_owns(&conn->pool, buf) == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  pthread_mutex_lock(&conn->lock);
+  pool_put(conn, buf);
+  pthread_cond_broadcast(&conn->cond);
+  pthread_mutex_unlock(&conn->lock);
+  return 0;
+}
+
+/*
+ * Closes the sending half: queues a FIN behind whatever is still in the
+ * send window and waits, up to the linger time, until the peer has ACKed
+ * all of it.  The socket is then detached and handed to the backend,
+ * which keeps answering the peer until its own FIN arrives (or the linger
+ * time runs out again) before it closes the descriptor and frees the
+ * block.  A linger that expires abandons whatever is unACKed.  Returns -1
+ * if the socket has no RUDP connection (the caller keeps ownership then).
+ */
+int rudp_conn_close(int sock) {
+  rudp_conn_t* conn = rudp_conn_get(sock);
+  if (conn == NULL) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&conn->lock);
+  long long linger_us = (long long)conn->linger_ms * 1000;
+  long long deadline_us = now_us() + linger_us;
+  struct timespec deadline;
+  deadline.tv_sec = deadline_us / 1000000;
+  deadline.tv_nsec = (deadline_us % 1000000) * 1000;
+
+  /* A dead peer gets no FIN, and there is nothing to wait for */
+  int timed_out = conn->dead;
+  while (window_full(conn) && timed_out == 0) {
+    timed_out = pthread_cond_timedwait(&conn->cond, &conn->lock, &deadline) == ETIMEDOUT;
+    timed_out = timed_out || conn->dead;
+  }
+  if (timed_out == 0) {
+    queue_packet(conn, FIN, NULL, 0);
+    pthread_mutex_unlock(&conn->lock);
+    conn_kick(conn);
+    pthread_mutex_lock(&conn->lock);
+  }
+  while (conn->count > 0 && timed_out == 0) {
+    timed_out = pthread_cond_timedwait(&conn->cond, &conn->lock, &deadline) == ETIMEDOUT;
+    timed_out = timed_out || conn->dead;
+  }
+  pthread_mutex_unlock(&conn->lock);
+
+  pthread_mutex_lock(&conns_lock);
+  int owned = (conn_table[sock] == conn);
+  if (owned) {
+    __atomic_store_n(&conn_table[sock], NULL, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&conns_lock);
+
+  if (owned == 0) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&conn->lock);
+  conn->close_us = now_us() + (timed_out ? 0 : linger_us);
+  __atomic_store_n(&conn->closed, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&conn->lock);
+
+  conn_kick(conn);
+  return 0;
+}
+
+/*
+ * Caller holds conn->lock.  Frees in-order ring slots whose STM packet
+ * already went to its stream; only DAT and FIN wait there for the reader.
+ */
+static void rq_pop_streamed(rudp_conn_t* conn) {
+  while (conn->rq_count > 0 && conn->recv_queue[conn->rq_head].streamed) {
+    conn->recv_queue[conn->rq_head].valid = 0;
+    conn->rq_head = (conn->rq_head + 1) % conn->rq_size;
+    conn->rq_count = conn->rq_count - 1;
+  }
+}
+
+/* Caller holds conn->lock.  The stream with `handle`, or NULL */
+static rudp_stream_t* stream_find(rudp_conn_t* conn, int handle) {
+  if (conn->streams == NULL || handle <= 0) {
+    return NULL;
+  }
+  for (int i = 0; i < RUDP_STREAMS_MAX; i++) {
+    if (conn->streams[i].handle == handle) {
+      return &conn->streams[i];
+    }
+  }
+  return NULL;
+}
+
+/* Caller holds conn->lock.  Claims a free entry for `handle` */
+static rudp_stream_t* stream_new(rudp_conn_t* conn, int handle) {
+  if (conn->streams == NULL) {
+    conn->streams = calloc(RUDP_STREAMS_MAX, sizeof(rudp_stream_t));
+    if (conn->streams == NULL) {
+      return NULL;
+    }
+    for (int i = 0; i < RUDP_STREAMS_MAX; i++) {
+      pthread_cond_init(&conn->streams[i].recv_cond, NULL);
+      pthread_cond_init(&conn->streams[i].send_cond, NULL);
+    }
+  }
+
+  for (int i = 0; i < RUDP_STREAMS_MAX; i++) {
+    rudp_stream_t* st = &conn->streams[i];
+    if (st->handle != 0) {
+      continue;
+    }
+    st->bufs = malloc((size_t)RUDP_STREAM_WINDOW * conn->mss);
+    if (st->bufs == NULL) {
+      return NULL;
+    }
+    st->handle = handle;
+    st->accepted = 0;
+    st->send_seq = 0;
+    st->send_limit = RUDP_STREAM_WINDOW;
+    st->send_closed = 0;
+    st->recv_seq = 0;
+    st->recv_granted = RUDP_STREAM_WINDOW;
+    st->recv_closed = 0;
+    for (int j = 0; j < RUDP_STREAM_WINDOW; j++) {
+      st->lens[j] = -1;
+      st->fins[j] = 0;
+    }
+    return st;
+  }
+
+  errno = EMFILE;
+  return NULL;
+}
+
+/* Caller holds conn->lock.  Both directions are done, so nothing refers to it */
+static void stream_retire(rudp_stream_t* st) {
+  if (st->send_closed && st->recv_closed) {
+    stream_free(st);
+  }
+}
+
+/*
+ * Caller holds conn->lock.  Queues a STM packet on `handle`, waiting for a
+ * window slot and a pool buffer, and for data also the peer's credit.  The
+ * stream is looked up again after every wait, since another thread may
+ * have closed it meanwhile.
+ */
+static int stream_queue(rudp_conn_t* conn, int handle, int flags, const char* buf, int len) {
+  rudp_stream_t* st;
+  int credit = (flags & RUDP_STM_CREDIT) != 0;
+
+  while (1) {
+    if (conn_alive(conn) != 0) {
+      return -1;
+    }
+    st = stream_find(conn, handle);
+    if (st == NULL || (st->send_closed && credit == 0)) {
+      errno = EPIPE;
+      return -1;
+    }
+    if (credit == 0 && st->send_seq >= st->send_limit) {
+      pthread_cond_wait(&st->send_cond, &conn->lock);
+      continue;
+    }
+    if (window_full(conn) == 0 && conn->pool.nfree > 0) {
+      break;
+    }
+    pthread_cond_wait(&conn->cond, &conn->lock);
+  }
+
+  rudp_stm_t hdr;
+  hdr.stream = handle / 2;
+  hdr.flags = flags | ((handle % 2 == 0) ? RUDP_STM_OPENER : 0);
+  hdr.seq = credit ? st->recv_granted : st->send_seq;
+
+  char* payload = pool_get(conn);
+  memcpy(payload, &hdr, sizeof(hdr));
+  if (len > 0) {
+    memcpy(payload + sizeof(hdr), buf, len);
+  }
+  queue_packet(conn, STM, payload, sizeof(hdr) + len);
+
+  if (credit == 0) {
+    st->send_seq = st->send_seq + 1;
+    if (flags & RUDP_STM_FIN) {
+      st->send_closed = 1;
+      stream_retire(st);
+    }
+  }
+  return len;
+}
+
+/* Opens a stream; the peer hears of it with the first packet sent on it */
+int stream_open(int sock) {
+  rudp_conn_t* conn = rudp_conn_get(sock);
+  if (conn == NULL) {
+    errno = ENOTCONN;
+    return -1;
+  }
+
+  pthread_mutex_lock(&conn->lock);
+  int handle = -1;
+  if (conn_alive(conn) != 0) {
+    /* errno already set */
+  } else if (conn->stream_opened >= USHRT_MAX) {
+    errno = EMFILE;
+  } else {
+    rudp_stream_t* st = stream_new(conn, (conn->stream_opened + 1) * 2);
+    if (st != NULL) {
+      st->accepted = 1;
+      conn->stream_opened = conn->stream_opened + 1;
+      handle = st->handle;
+    }
+  }
+  pthread_mutex_unlock(&conn->lock);
+  return handle;
+}
+
+/* Blocks until the peer opens a stream; 0 once it has closed the connection */
+int stream_accept(int sock) {
+  rudp_conn_t* conn = rudp_conn_get(sock);
+  if (conn == NULL) {
+    errno = ENOTCONN;
+    return -1;
+  }
+
+  pthread_mutex_lock(&conn->lock);
+  int handle = 0;
+  while (handle == 0) {
+    for (int i = 0; conn->streams != NULL && i < RUDP_STREAMS_MAX && handle == 0; i++) {
+      rudp_stream_t* st = &conn->streams[i];
+      if (st->handle % 2 == 1 && st->accepted == 0) {
+        st->accepted = 1;
+        handle = st->handle;
+      }
+    }
+    if (handle == 0 && conn->peer_fin) {
+      break;
+    }
+    if (handle == 0 && conn_alive(conn) != 0) {
+      handle = -1;
+      break;
+    }
+    if (handle == 0) {
+      pthread_cond_wait(&conn->recv_cond, &conn->lock);
+    }
+  }
+  pthread_mutex_unlock(&conn->lock);
+  return handle;
+}
+
+int stream_send(int sock, int handle, const char* buf, int len) {
+  rudp_conn_t* conn = rudp_conn_get(sock);
+  if (conn == NULL) {
+    errno = ENOTCONN;
+    return -1;
+  }
+  if (len < 0 || len > conn->mss - (int)sizeof(rudp_stm_t)) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+
+  pthread_mutex_lock(&conn->lock);
+  int ret = stream_queue(conn, handle, 0, buf, len);
+  pthread_mutex_unlock(&conn->lock);
+
+  if (ret >= 0) {
+    conn_kick(conn);
+  }
+  return ret;
+}
+
+/* Sends the stream's end; it is freed once the peer's end has been read too */
+int stream_close(int sock, int handle) {
+  rudp_conn_t* conn = rudp_conn_get(sock);
+  if (conn == NULL) {
+    errno = ENOTCONN;
+    return -1;
+  }
+
+  pthread_mutex_lock(&conn->lock);
+  int ret = stream_queue(conn, handle, RUDP_STM_FIN, NULL, 0);
+  pthread_mutex_unlock(&conn->lock);
+
+  if (ret < 0) {
+    return -1;
+  }
+  conn_kick(conn);
+  return 0;
+}
+
+/*
+ * Blocks until the stream's next packet is in and copies it out; 0 at the
+ * stream's end, or if the connection ends first.  Every half window read
+ * grants the peer that much more credit.
+ */
+int stream_recv(int sock, int handle, char* buf, int len) {
+  rudp_conn_t* conn = rudp_conn_get(sock);
+  if (conn == NULL) {
+    errno = ENOTCONN;
+    return -1;
+  }
+
+  pthread_mutex_lock(&conn->lock);
+
+  rudp_stream_t* st;
+  int idx;
+  while (1) {
+    if (conn_alive(conn) != 0) {
+      pthread_mutex_unlock(&conn->lock);
+      return -1;
+    }
+    st = stream_find(conn, handle);
+    if (st == NULL) {
+      pthread_mutex_unlock(&conn->lock);
+      errno = EBADF;
+      return -1;
+    }
+    idx = st->recv_seq % RUDP_STREAM_WINDOW;
+    if (st->recv_closed || st->lens[idx] >= 0 || conn->peer_fin) {
+      break;
+    }
+    pthread_cond_wait(&st->recv_cond, &conn->lock);
+  }
+
+  if (st->lens[idx] < 0 || st->fins[idx]) {
+    st->recv_closed = 1;
+    stream_retire(st);
+    pthread_mutex_unlock(&conn->lock);
+    return 0;
+  }
+
+  int n = st->lens[idx];
+  if (n > len) {
+    n = len;
+  }
+  if (n > 0) {
+    memcpy(buf, st->bufs + (size_t)idx * conn->mss, n);
+  }
+  st->lens[idx] = -1;
+  st->recv_seq = st->recv_seq + 1;
+
+  int granted = 0;
+  if (st->recv_seq + RUDP_STREAM_WINDOW - st->recv_granted >= RUDP_STREAM_WINDOW / 2) {
+    st->recv_granted = st->recv_seq + RUDP_STREAM_WINDOW;
+    granted = stream_queue(conn, handle, RUDP_STM_CREDIT, NULL, 0) == 0;
+  }
+
+  pthread_mutex_unlock(&conn->lock);
+
+  if (granted) {
+    conn_kick(conn);
+  }
+  return n;
+}
+
+/*
+ * Caller holds conn->lock.  Decompresses a received payload into `buf`,
+ * cut to `len` bytes like any other; -1 with EBADMSG if it is corrupt.
+ */
+static int lz_unpack(rudp_conn_t* conn, rq_entry_t* entry, char* buf, int len) {
+  long long start = now_ns();
+  int n;
+  if (len >= conn->mss) {
+    n = rudp_lz_decompress(entry->data, entry->len, buf, len);
+  } else {
+    if (conn->lz_rx == NULL) {
+      conn->lz_rx = malloc(conn->mss);
+      if (conn->lz_rx == NULL) {
+        errno = ENOMEM;
+        return -1;
+      }
+    }
+    n = rudp_lz_decompress(entry->data, entry->len, conn->lz_rx, conn->mss);
+    if (n > len) {
+      n = len;
+    }
+    if (n > 0) {
+      memcpy(buf, conn->lz_rx, n);
+    }
+  }
+  conn->stats.unlz_ns = conn->stats.unlz_ns + (now_ns() - start);
+  if (n < 0) {
+    errno = EBADMSG;
+  }
+  return n;
+}
+
+/* Blocks until the next in-order payload is available and copies it out */
+int dequeue_received(int sock, char* buf, int len) {
+  rudp_conn_t* conn = rudp_conn_get(sock);
+  if (conn == NULL) {
+    errno = ENOTCONN;
+    return -1;
+  }
+
+  pthread_mutex_lock(&conn->lock);
+
+  while (conn->rq_count == 0 && conn->dead == 0) {
+    pthread_cond_wait(&conn->recv_cond, &conn->lock);
+  }
+  if (conn_alive(conn) != 0) {
+    pthread_mutex_unlock(&conn->lock);
+    return -1;
+  }
+
+  /* The FIN stays put, so every later call reports end of stream too */
+  rq_entry_t* entry = &conn->recv_queue[conn->rq_head];
+  if (entry->fin) {
+    pthread_mutex_unlock(&conn->lock);
+    return 0;
+  }
+
+  int payload_len = entry->len;
+  int err = 0;
+  if (entry->lz) {
+    /* A payload that won't decompress is dropped, not retried forever */
+    payload_len = lz_unpack(conn, entry, buf, len);
+    err = errno;
+  } else {
+    if (payload_len > len) {
+      payload_len = len;
+    }
+    if (payload_len > 0) {
+      memcpy(buf, entry->data, payload_len);
+    }
+  }
+
+  entry->valid = 0;
+  conn->rq_head = (conn->rq_head + 1) % conn->rq_size;
+  conn->rq_count = conn->rq_count - 1;
+  rq_pop_streamed(conn);
+
+  /* The peer stopped sending on our zero window; tell it there is room */
+  int reopened = conn->rwnd_closed;
+  if (reopened) {
+    conn->rwnd_closed = 0;
+    conn->wnd_update = 1;
+  }
+
+  pthread_mutex_unlock(&conn->lock);
+
+  if (reopened) {
+    conn_kick(conn);
+  }
+  if (payload_len < 0) {
+    errno = err;
+  }
+  return payload_len;
+}
+
+int rudp_get_stats(int sock, rudp_stats_t* stats) {
+  rudp_conn_t* conn = rudp_conn_get(sock);
+  if (conn == NULL || stats == NULL) {
+    errno = (conn == NULL) ? ENOTCONN : EINVAL;
+    return -1;
+  }
+
+  pthread_mutex_lock(&conn->lock);
+  *stats = conn->stats;
+  stats->pool_size = conn->pool.size;
+  stats->pool_in_use = conn->pool.size - conn->pool.nfree;
+  stats->cc_algorithm = conn->cc.algorithm;
+  stats->cwnd = rudp_cc_window(&conn->cc);
+  stats->ssthresh = (unsigned int)conn->cc.ssthresh;
+  stats->reorder_held = conn->rq_ooo;
+  stats->mss = conn->mss;
+  stats->max_payload = conn->plpmtu;
+  stats->fec_group = conn->fec_group;
+  stats->loss_permille = (unsigned int)(conn->loss_rate * 1000);
+  stats->streams_open = 0;
+  for (int i = 0; conn->streams != NULL && i < RUDP_STREAMS_MAX; i++) {
+    if (conn->streams[i].handle != 0) {
+      stats->streams_open = stats->streams_open + 1;
+    }
+  }
+  pthread_mutex_unlock(&conn->lock);
+  return 0;
+}
+
+/* Largest payload known to cross the path unfragmented */
+int rudp_max_payload(int sock) {
+  rudp_conn_t* conn = rudp_conn_get(sock);
+  if (conn == NULL) {
+    errno = ENOTCONN;
+    return -1;
+  }
+
+  pthread_mutex_lock(&conn->lock);
+  int max_payload = conn->plpmtu;
+  pthread_mutex_unlock(&conn->lock);
+  return max_payload;
+}
+
+/* Window entry holding `seqnum`, which must be within the send window */
+static swnd_entry_t* swnd_entry(rudp_conn_t* conn, int seqnum) {
+  return &conn->send_window[(conn->head + (seqnum - conn->send_seqnum)) % conn->swnd_size];
+}
+
+/*
+ * Caller holds conn->lock.  Marks in-flight packets lost, ahead of their
+ * RTO, when RUDP_DUPTHRESH later packets were SACKed (or, for the head, as
+ * many duplicate ACKs arrived), or RACK-style when a packet sent more than
+ * a quarter RTT after it has been delivered.  The last rule is the only one
+ * that applies to retransmissions.  The first loss of a flight starts a
+ * recovery episode, which is when congestion control backs off.
+ */
+static int detect_losses(rudp_conn_t* conn, long long now) {
+  long long reo_wnd = conn->rtt.srtt_us / 4;
+  if (reo_wnd < RUDP_CLOCK_G_US) reo_wnd = RUDP_CLOCK_G_US;
+
+  int newly_lost = 0;
+  int sacked_above = 0;
+
+  for (int i = conn->in_flight - 1; i >= 0; i--) {
+    swnd_entry_t* entry = &conn->send_window[(conn->head + i) % conn->swnd_size];
+    if (entry->sacked) {
+      sacked_above = sacked_above + 1;
+      continue;
+    }
+    if (entry->lost) {
+      continue;
+    }
+
+    /* Its group's parity is on the way and may rebuild it at the peer */
+    if (entry->fec_us != 0 && entry->retransmitted == 0 && conn->rack_us <= entry->fec_us + reo_wnd) {
+      continue;
+    }
+
+    int lost = conn->rack_us > entry->sent_us + reo_wnd;
+    if (entry->retransmitted == 0) {
+      lost = lost || sacked_above >= RUDP_DUPTHRESH ||
+             (i == 0 && conn->dupacks >= RUDP_DUPTHRESH);
+    }
+    if (lost) {
+      entry->lost = 1;
+      conn->nlost = conn->nlost + 1;
+      newly_lost = newly_lost + 1;
+    }
+  }
+
+  if (newly_lost == 0) {
+    return 0;
+  }
+
+  conn->stats.fast_retransmits = conn->stats.fast_retransmits + newly_lost;
+  conn->fec_lost = conn->fec_lost + newly_lost;
+  if (conn->in_recovery == 0) {
+    conn->in_recovery = 1;
+    conn->recover_seq = conn->send_seqnum + conn->in_flight - 1;
+    rudp_cc_on_loss(&conn->cc, now);
+  }
+  return newly_lost;
+}
+
+/*
+ * Applies an ACK: releases every packet up to and including its cumulative
+ * seqnum, marks the ranges in its SACK blocks and looks for losses.
+ * Returns nonzero if the ACK told us anything new.
+ */
+static int process_ack(rudp_conn_t* conn, rudp_packet_t* pkt, int payload_len) {
+  pthread_mutex_lock(&conn->lock);
+
+  int acked = pkt->seqnum - conn->send_seqnum + 1;
+  if (acked < 0 || acked > conn->in_flight) {
+    pthread_mutex_unlock(&conn->lock);
+    return 0;
+  }
+
+  /* The peer's window only ever slides forward; reordered ACKs can't shrink it */
+  int window_opened = 0;
+  int edge = pkt->seqnum + 1 + pkt->window;
+  if (edge > conn->peer_edge) {
+    conn->peer_edge = edge;
+    window_opened = 1;
+  }
+  conn->stats.peer_window = pkt->window;
+
+  /* The peer rebuilt a packet from parity: a loss FEC_AUTO should count */
+  if (pkt->type == (ACK | FEC)) {
+    conn->fec_lost = conn->fec_lost + 1;
+    conn->stats.fec_peer_recovered = conn->stats.fec_peer_recovered + 1;
+  }
+
+  /* A duplicate says the peer got something past a hole; window updates don't */
+  if (acked > 0) {
+    conn->dupacks = 0;
+  } else if (conn->in_flight > 0 && window_opened == 0) {
+    conn->dupacks = conn->dupacks + 1;
+  }
+
+  /* Highest-seqnum packet newly known to have arrived, for the RTT sample */
+  swnd_entry_t* newest = NULL;
+  if (acked > 0) {
+    newest = swnd_entry(conn, pkt->seqnum);
+  }
+
+  int delay_us = 0;
+  int nblocks = 0;
+  if (payload_len >= (int)sizeof(rudp_ack_t)) {
+    memcpy(&delay_us, pkt->payload + offsetof(rudp_ack_t, delay_us), sizeof(delay_us));
+    nblocks = (payload_len - (int)sizeof(rudp_ack_t)) / (int)sizeof(rudp_sack_t);
+  }
+  if (nblocks > RUDP_SACK_MAX) {
+    nblocks = RUDP_SACK_MAX;
+  }
+  int newest_seq = pkt->seqnum;
+  int sacked = 0;
+  int delivered = 0;
+
+  for (int b = 0; b < nblocks; b++) {
+    rudp_sack_t block;
+    memcpy(&block, pkt->payload + offsetof(rudp_ack_t, sacks) + b * sizeof(rudp_sack_t),
+           sizeof(block));
+
+    int first = conn->send_seqnum + acked;
+    int last = conn->send_seqnum + conn->in_flight - 1;
+    if (block.start > first) first = block.start;
+    if (block.end < last) last = block.end;
+
+    for (int seq = first; seq <= last; seq++) {
+      swnd_entry_t* entry = swnd_entry(conn, seq);
+      if (entry->sacked == 0) {
+        entry->sacked = 1;
+        if (entry->lost) {
+          entry->lost = 0;
+          conn->nlost = conn->nlost - 1;
+        }
+        sacked = sacked + 1;
+        if (entry->sent_us > conn->rack_us) {
+          conn->rack_us = entry->sent_us;
+        }
+        if (newest == NULL || seq > newest_seq) {
+          newest = entry;
+          newest_seq = seq;
+        }
+      }
+    }
+  }
+
+  if (acked == 0 && sacked == 0) {
+    int lost = 0;
+    if (conn->dupacks >= RUDP_DUPTHRESH) {
+      lost = detect_losses(conn, now_us());
+    }
+    pthread_mutex_unlock(&conn->lock);
+    return window_opened || lost;
+  }
+
+  /*
+   * Karn's rule: a packet that was ever resent gives an ambiguous sample.
+   * New data being acknowledged still proves the path is alive, so the
+   * timer backoff is dropped either way; otherwise a recovery round after
+   * a loss could leave every ACK ambiguous and the RTO would only grow.
+   */
+  long long now = now_us();
+  long long sample_us = 0;
+  if (newest->retransmitted == 0) {
+    sample_us = now - newest->sent_us;
+    /* Time the peer sat on the ACK is not path delay */
+    if (delay_us > 0 && delay_us < sample_us) {
+      sample_us = sample_us - delay_us;
+    }
+    rtt_sample(&conn->rtt, sample_us);
+  } else if (conn->rtt.backoff > 0) {
+    rtt_reset_backoff(&conn->rtt);
+  }
+
+  for (int i = 0; i < acked; i++) {
+    swnd_entry_t* entry = &conn->send_window[conn->head];
+    if (entry->sacked) {
+      conn->nsacked = conn->nsacked - 1;
+    } else {
+      delivered = delivered + 1;
+      if (entry->sent_us > conn->rack_us) {
+        conn->rack_us = entry->sent_us;
+      }
+    }
+    if (entry->lost) {
+      conn->nlost = conn->nlost - 1;
+    }
+    if (entry->payload != NULL) {
+      pool_put(conn, entry->payload);
+      entry->payload = NULL;
+    }
+    conn->head = (conn->head + 1) % conn->swnd_size;
+  }
+
+  conn->nsacked = conn->nsacked + sacked;
+  rudp_cc_on_ack(&conn->cc, delivered + sacked, sample_us, now);
+
+  conn->send_seqnum = conn->send_seqnum + acked;
+  conn->count = conn->count - acked;
+  conn->in_flight = conn->in_flight - acked;
+
+  if (acked > 0) {
+    conn->tlp_sent = 0;
+    if (conn->in_recovery && conn->send_seqnum > conn->recover_seq) {
+      conn->in_recovery = 0;
+    }
+    pthread_cond_broadcast(&conn->cond);
+  }
+
+  if (conn->in_flight > 0) {
+    detect_losses(conn, now);
+  }
+
+  pthread_mutex_unlock(&conn->lock);
+  return 1;
+}
+
+static void count_io(rudp_conn_t* conn, int tx, int packets) {
+  pthread_mutex_lock(&conn->lock);
+  if (tx) {
+    conn->stats.tx_syscalls = conn->stats.tx_syscalls + 1;
+    conn->stats.tx_packets = conn->stats.tx_packets + packets;
+  } else {
+    conn->stats.rx_syscalls = conn->stats.rx_syscalls + 1;
+    conn->stats.rx_packets = conn->stats.rx_packets + packets;
+  }
+  pthread_mutex_unlock(&conn->lock);
+}
+
+/*
+ * Backend only: marks a packet built in `pkt` and appends its CRC32C if
+ * the connection uses them; `pkt` has RUDP_CRC_LEN bytes to spare.
+ * Returns the length to send.
+ */
+static int crc_seal(rudp_conn_t* conn, char* pkt, int len) {
+  if (conn->crc == 0) {
+    return len;
+  }
+  rudp_header_t hdr;
+  memcpy(&hdr, pkt, sizeof(hdr));
+  hdr.flags = hdr.flags | RUDP_HDR_CRC;
+  memcpy(pkt, &hdr, sizeof(hdr));
+  uint32_t crc = rudp_crc32c(0, pkt, len);
+  memcpy(pkt + len, &crc, sizeof(crc));
+  return len + RUDP_CRC_LEN;
+}
+
+/*
+ * Backend only: checks a received datagram's CRC32C and takes it off the
+ * length.  -1 for a datagram to drop: a bad CRC, or none on a connection
+ * that agreed to them, where only the handshake's SYNs go without.
+ */
+static int crc_check(rudp_conn_t* conn, const char* pkt, int* len) {
+  if (*len < (int)sizeof(rudp_header_t)) {
+    return 0;
+  }
+  rudp_header_t hdr;
+  memcpy(&hdr, pkt, sizeof(hdr));
+  if ((hdr.flags & RUDP_HDR_CRC) == 0) {
+    return (conn->crc && (hdr.type & SYN) == 0) ? -1 : 0;
+  }
+
+  int body = *len - RUDP_CRC_LEN;
+  if (body < (int)sizeof(rudp_header_t)) {
+    return -1;
+  }
+  uint32_t crc;
+  memcpy(&crc, pkt + body, sizeof(crc));
+  if (rudp_crc32c(0, pkt, body) != crc) {
+    return -1;
+  }
+  *len = body;
+  return 0;
+}
+
+static size_t iov_bytes(const struct iovec* iov, int count) {
+  size_t bytes = 0;
+  for (int i = 0; i < count; i++) {
+    bytes = bytes + iov[i].iov_len;
+  }
+  return bytes;
+}
+
+/*
+ * Sends `n` datagrams to the peer in one sendmmsg, each gathered from
+ * `per` consecutive entries of `iov`; returns how many went out.  With UDP
+ * GSO, each run of equal-sized datagrams (the last may be shorter) becomes
+ * one message that the kernel segments again, so the stack is walked once
+ * per run instead of once per datagram.
+ */
+static int send_batch(rudp_conn_t* conn, struct iovec* iov, int per, int n) {
+  struct mmsghdr msgs[RUDP_BATCH];
+  char ctrl[RUDP_BATCH][CMSG_SPACE(sizeof(uint16_t))];
+  int segs[RUDP_BATCH];
+  int nmsgs = 0;
+
+  memset(msgs, 0, n * sizeof(struct mmsghdr));
+  for (int i = 0; i < n; i = i + segs[nmsgs - 1]) {
+    size_t size = iov_bytes(&iov[i * per], per);
+    size_t last = size;
+    int run = 1;
+    while (conn->gso && i + run < n && run < RUDP_GSO_SEGS && last == size &&
+           (run + 1) * size <= RUDP_GSO_BYTES) {
+      size_t next = iov_bytes(&iov[(i + run) * per], per);
+      if (next > size) {
+        break;
+      }
+      last = next;
+      run = run + 1;
+    }
+
+    struct msghdr* hdr = &msgs[nmsgs].msg_hdr;
+    hdr->msg_name = &conn->peer;
+    hdr->msg_namelen = conn->peerlen;
+    hdr->msg_iov = &iov[i * per];
+    hdr->msg_iovlen = run * per;
+    if (run > 1) {
+      uint16_t gso_size = (uint16_t)size;
+      hdr->msg_control = ctrl[nmsgs];
+      hdr->msg_controllen = sizeof(ctrl[nmsgs]);
+      struct cmsghdr* cmsg = CMSG_FIRSTHDR(hdr);
+      cmsg->cmsg_level = SOL_UDP;
+      cmsg->cmsg_type = UDP_SEGMENT;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(gso_size));
+      memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+    }
+    segs[nmsgs] = run;
+    nmsgs = nmsgs + 1;
+  }
+
+  int sent = sendmmsg(conn->socket, msgs, nmsgs, 0);
+  if (sent < 0 && nmsgs < n && (errno == EIO || errno == EINVAL || errno == EOPNOTSUPP)) {
+    /* The route can't checksum a GSO buffer; send datagrams from now on */
+    conn->gso = 0;
+    return send_batch(conn, iov, per, n);
+  }
+  if (sent <= 0) {
+    return 0;
+  }
+
+  int datagrams = 0;
+  for (int i = 0; i < sent; i++) {
+    datagrams = datagrams + segs[i];
+  }
+  count_io(conn, 1, datagrams);
+  return datagrams;
+}
+
+/* dst ^= src, a word at a time */
+static void xor_bytes(char* dst, const char* src, int len) {
+  int i = 0;
+  for (; i + (int)sizeof(uint64_t) <= len; i = i + sizeof(uint64_t)) {
+    uint64_t a;
+    uint64_t b;
+    memcpy(&a, dst + i, sizeof(a));
+    memcpy(&b, src + i, sizeof(b));
+    a = a ^ b;
+    memcpy(dst + i, &a, sizeof(a));
+  }
+  for (; i < len; i++) {
+    dst[i] = dst[i] ^ src[i];
+  }
+}
+
+/* Data packets per parity packet for a RUDP_OPT_FEC value */
+static int fec_group_size(int mode, double loss_rate) {
+  if (mode != RUDP_FEC_AUTO) {
+    return mode;
+  }
+  if (loss_rate < RUDP_FEC_MIN_LOSS) {
+    return 0;
+  }
+
+  int group = (int)(RUDP_FEC_TARGET / loss_rate) - 1;
+  if (group < 1) group = 1;
+  if (group > RUDP_FEC_MAX) group = RUDP_FEC_MAX;
+  return group;
+}
+
+/* Backend only: sends the parity of the group built so far and starts a new one */
+static void fec_flush(rudp_conn_t* conn, long long now) {
+  rudp_packet_t* pkt = (rudp_packet_t*)conn->fec_tx;
+  rudp_fec_t* fec = (rudp_fec_t*)pkt->payload;
+  pkt->type = FEC;
+  pkt->window = conn->fec_count;
+  pkt->seqnum = conn->fec_start;
+
+  int len = crc_seal(conn, conn->fec_tx, sizeof(rudp_packet_t) + sizeof(rudp_fec_t) + conn->fec_len);
+  if (sendto(conn->socket, pkt, len, 0, (struct sockaddr*)&conn->peer, conn->peerlen) >= 0) {
+    count_io(conn, 1, 1);
+
+    /* Members already ACKed have left the window */
+    int first = conn->fec_start;
+    if (first < conn->send_seqnum) first = conn->send_seqnum;
+    for (int seq = first; seq < conn->fec_start + conn->fec_count; seq++) {
+      swnd_entry(conn, seq)->fec_us = now;
+    }
+
+    pthread_mutex_lock(&conn->lock);
+    conn->stats.fec_parity_sent = conn->stats.fec_parity_sent + 1;
+    pthread_mutex_unlock(&conn->lock);
+  }
+
+  /* The CRC trailer went right after the parity; the next group must not XOR into it */
+  memset(fec->parity, 0, conn->fec_len + RUDP_CRC_LEN);
+  conn->fec_count = 0;
+}
+
+/*
+ * Backend only: counts a first transmission toward the loss estimate and,
+ * with FEC on, folds a DAT into the parity group; a gap in seqnums (a FIN
+ * in between) closes the group early.
+ */
+static void fec_add(rudp_conn_t* conn, swnd_entry_t* entry, long long now) {
+  conn->fec_sent = conn->fec_sent + 1;
+  if (conn->fec_sent >= RUDP_FEC_EPOCH) {
+    double rate = (double)conn->fec_lost / conn->fec_sent;
+    conn->loss_rate = (conn->loss_rate + rate) / 2;
+    conn->fec_sent = 0;
+    conn->fec_lost = 0;
+  }
+
+  if (conn->fec_group == 0 || entry->hdr.type != DAT) {
+    return;
+  }
+  if (conn->fec_tx == NULL) {
+    conn->fec_tx = calloc(1, sizeof(rudp_packet_t) + sizeof(rudp_fec_t) + conn->mss + RUDP_CRC_LEN);
+    if (conn->fec_tx == NULL) {
+      return;
+    }
+  }
+  if (conn->fec_count > 0 && entry->hdr.seqnum != conn->fec_start + conn->fec_count) {
+    fec_flush(conn, now);
+  }
+
+  rudp_fec_t* fec = (rudp_fec_t*)((rudp_packet_t*)conn->fec_tx)->payload;
+  int len = entry->packetlen - sizeof(rudp_header_t);
+  if (conn->fec_count == 0) {
+    conn->fec_start = entry->hdr.seqnum;
+    conn->fec_len = 0;
+    fec->len_xor = 0;
+  }
+  fec->len_xor = fec->len_xor ^ len ^ ((entry->hdr.flags & RUDP_HDR_LZ) ? RUDP_FEC_LZ : 0);
+  xor_bytes(fec->parity, entry->payload, len);
+  if (len > conn->fec_len) {
+    conn->fec_len = len;
+  }
+
+  conn->fec_count = conn->fec_count + 1;
+  if (conn->fec_count >= conn->fec_group) {
+    fec_flush(conn, now);
+  }
+}
+
+/*
+ * Sends a batch of window entries.  Entries never sent before join the
+ * in-flight range, resent ones are marked for Karn's rule.  Returns how
+ * many went out; on a short send the retry timer is armed.
+ */
+static int transmit_batch(rudp_conn_t* conn, swnd_entry_t** batch, int n) {
+  /* Header, payload and CRC are gathered by the kernel, never copied together */
+  struct iovec iov[3 * RUDP_BATCH];
+  int per = conn->crc ? 3 : 2;
+  for (int i = 0; i < n; i++) {
+    swnd_entry_t* entry = batch[i];
+    int len = entry->packetlen - sizeof(rudp_header_t);
+    iov[per * i].iov_base = &entry->hdr;
+    iov[per * i].iov_len = sizeof(rudp_header_t);
+    iov[per * i + 1].iov_base = entry->payload;
+    iov[per * i + 1].iov_len = len;
+    if (per == 3) {
+      if (entry->sent_us == 0) {
+        entry->hdr.flags = entry->hdr.flags | RUDP_HDR_CRC;
+        entry->crc = rudp_crc32c(rudp_crc32c(0, &entry->hdr, sizeof(rudp_header_t)), entry->payload, len);
+      }
+      iov[per * i + 2].iov_base = &entry->crc;
+      iov[per * i + 2].iov_len = RUDP_CRC_LEN;
+    }
+  }
+
+  int sent = send_batch(conn, iov, per, n);
+  if (sent < n) {
+    arm_timer(conn->shard, now_us() + RUDP_SEND_RETRY_US);
+  }
+
+  long long now = now_us();
+  for (int i = 0; i < sent; i++) {
+    swnd_entry_t* entry = batch[i];
+    if (entry->sent_us != 0) {
+      entry->retransmitted = 1;
+    } else {
+      conn->in_flight = conn->in_flight + 1;
+      fec_add(conn, entry, now);
+    }
+    if (entry->lost) {
+      entry->lost = 0;
+      conn->nlost = conn->nlost - 1;
+    }
+    entry->sent_us = now;
+  }
+  return sent;
+}
+
+/* Appends to the pending batch and flushes it once full; -1 if the send fell short */
+static int batch_add(rudp_conn_t* conn, swnd_entry_t** batch, int* n, swnd_entry_t* entry) {
+  batch[*n] = entry;
+  *n = *n + 1;
+  if (*n < RUDP_BATCH) {
+    return 0;
+  }
+
+  int want = *n;
+  *n = 0;
+  return transmit_batch(conn, batch, want) == want ? 0 : -1;
+}
+
+/*
+ * Schedules a tail-loss probe two RTTs (plus the longest a peer may delay
+ * its ACK) after the newest send, so losses at
+ * the end of a burst, which produce no duplicate ACKs, are found before
+ * the RTO.  One probe per flight; any cumulative progress allows the next.
+ */
+static void arm_tail_probe(rudp_conn_t* conn) {
+  conn->tlp_us = 0;
+  if (conn->in_flight == 0 || conn->in_recovery || conn->tlp_sent || conn->rtt.srtt_us == 0) {
+    return;
+  }
+
+  swnd_entry_t* newest = &conn->send_window[(conn->head + conn->in_flight - 1) % conn->swnd_size];
+  long long deadline = newest->sent_us + 2 * conn->rtt.srtt_us + RUDP_ACK_DELAY_MAX_US;
+  if (deadline < conn->send_window[conn->head].sent_us + conn->rtt.rto_us) {
+    conn->tlp_us = deadline;
+    arm_timer(conn->shard, deadline);
+  }
+}
+
+/* Resends the newest unSACKed packet so its ACK reveals what is missing */
+static void send_tail_probe(rudp_conn_t* conn) {
+  conn->tlp_us = 0;
+  conn->tlp_sent = 1;
+
+  for (int i = conn->in_flight - 1; i >= 0; i--) {
+    swnd_entry_t* entry = &conn->send_window[(conn->head + i) % conn->swnd_size];
+    if (entry->sacked == 0) {
+      transmit_batch(conn, &entry, 1);
+
+      pthread_mutex_lock(&conn->lock);
+      conn->stats.tail_probes = conn->stats.tail_probes + 1;
+      pthread_mutex_unlock(&conn->lock);
+      return;
+    }
+  }
+}
+
+/* Caller holds conn->lock.  A full-sized datagram at the current path MTU */
+static int full_packet(rudp_conn_t* conn) {
+  return sizeof(rudp_header_t) + conn->plpmtu;
+}
+
+/* Caller holds conn->lock.  Bytes per second to pace at, 0 for unpaced */
+static double pacing_rate(rudp_conn_t* conn) {
+  if (conn->pacing == RUDP_PACING_OFF) {
+    return 0;
+  }
+  if (conn->pacing > 0) {
+    return conn->pacing;
+  }
+  /* No RTT yet: the initial window goes out unpaced, as TCP's does */
+  return rudp_cc_pacing_rate(&conn->cc, conn->rtt.srtt_us) * full_packet(conn);
+}
+
+static void pace_refill(rudp_conn_t* conn, double rate, int packet, long long now) {
+  double depth = rate * RUDP_PACING_QUANTUM_US / 1e6;
+  if (depth < RUDP_PACING_BURST * packet) {
+    depth = RUDP_PACING_BURST * packet;
+  }
+
+  if (conn->pace_stamp_us != 0) {
+    conn->pace_tokens = conn->pace_tokens + rate * (double)(now - conn->pace_stamp_us) / 1e6;
+  }
+  if (conn->pace_stamp_us == 0 || conn->pace_tokens > depth) {
+    conn->pace_tokens = depth;
+  }
+  conn->pace_stamp_us = now;
+}
+
+/* Takes tokens for `entry`; 0 when the bucket is short and sending must wait */
+static int pace_take(rudp_conn_t* conn, double rate, swnd_entry_t* entry) {
+  if (rate == 0) {
+    return 1;
+  }
+  if (conn->pace_tokens < entry->packetlen) {
+    return 0;
+  }
+  conn->pace_tokens = conn->pace_tokens - entry->packetlen;
+  return 1;
+}
+
+/* Zeros that pad PMTU probes out to the size under test */
+static const char pmtu_pad[RUDP_MSS_MAX];
+
+/*
+ * Probes go out with IP_PMTUDISC_PROBE, which sets DF and never fragments,
+ * and data with the default IP_PMTUDISC_WANT, which lets the kernel
+ * fragment whatever exceeds the route MTU.  Only the backend sends on the
+ * socket, so switching around a probe cannot catch a data packet.
+ */
+static void set_pmtu_mode(rudp_conn_t* conn, int probe) {
+  int mode = probe ? IP_PMTUDISC_PROBE : IP_PMTUDISC_WANT;
+  (void)setsockopt(conn->socket, IPPROTO_IP, IP_MTU_DISCOVER, &mode, sizeof(mode));
+  if (conn->peer.ss_family == AF_INET6) {
+    mode = probe ? IPV6_PMTUDISC_PROBE : IPV6_PMTUDISC_WANT;
+    (void)setsockopt(conn->socket, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &mode, sizeof(mode));
+  }
+}
+
+/* A PRB padded to `size` bytes of payload; -1 if the local route can't carry it */
+static int send_pmtu_probe(rudp_conn_t* conn, int size) {
+  rudp_header_t hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.type = PRB;
+  hdr.seqnum = conn->probe_seq;
+
+  struct iovec iov[3];
+  iov[0].iov_base = &hdr;
+  iov[0].iov_len = sizeof(hdr);
+  iov[1].iov_base = (void*)pmtu_pad;
+  iov[1].iov_len = size;
+
+  uint32_t crc = 0;
+  if (conn->crc) {
+    hdr.flags = RUDP_HDR_CRC;
+    crc = rudp_crc32c(rudp_crc32c(0, &hdr, sizeof(hdr)), pmtu_pad, size);
+  }
+  iov[2].iov_base = &crc;
+  iov[2].iov_len = conn->crc ? RUDP_CRC_LEN : 0;
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = &conn->peer;
+  msg.msg_namelen = conn->peerlen;
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 3;
+
+  set_pmtu_mode(conn, 1);
+  ssize_t sent = sendmsg(conn->socket, &msg, 0);
+  int err = errno;
+  set_pmtu_mode(conn, 0);
+
+  if (sent < 0) {
+    return (err == EMSGSIZE) ? -1 : 0;
+  }
+  count_io(conn, 1, 1);
+
+  pthread_mutex_lock(&conn->lock);
+  conn->stats.pmtu_probes = conn->stats.pmtu_probes + 1;
+  pthread_mutex_unlock(&conn->lock);
+  return 0;
+}
+
+/*
+ * Backend only: the probe timer fired, or the last probe was answered.  An
+ * unanswered size is retried until RUDP_PMTU_PROBES have gone out and then
+ * becomes the new ceiling.  The next size tried is the ceiling itself if
+ * nothing has failed yet, which settles loopback and jumbo paths in one
+ * round trip, and otherwise halfway up from the validated size.
+ */
+static void pmtu_probe(rudp_conn_t* conn, long long now) {
+  if (conn->probe_size != 0) {
+    conn->probe_tries = conn->probe_tries + 1;
+    if (conn->probe_tries >= RUDP_PMTU_PROBES) {
+      conn->pmtu_ceiling = conn->probe_size - 1;
+      conn->probe_size = 0;
+    }
+  }
+
+  while (1) {
+    if (conn->probe_size == 0) {
+      if (conn->pmtu_ceiling - conn->plpmtu < RUDP_PMTU_STEP) {
+        /* Done; search again later in case the path has grown */
+        conn->pmtu_ceiling = conn->mss;
+        conn->probe_us = now + RUDP_PMTU_RAISE_US;
+        arm_timer(conn->shard, conn->probe_us);
+        return;
+      }
+      if (conn->pmtu_ceiling == conn->mss) {
+        conn->probe_size = conn->pmtu_ceiling;
+      } else {
+        conn->probe_size = (conn->plpmtu + conn->pmtu_ceiling + 1) / 2;
+      }
+      conn->probe_seq = conn->probe_seq + 1;
+      conn->probe_tries = 0;
+    }
+
+    if (send_pmtu_probe(conn, conn->probe_size) == 0) {
+      break;
+    }
+    /* Larger than the local interface takes; no answer can come */
+    conn->pmtu_ceiling = conn->probe_size - 1;
+    conn->probe_size = 0;
+  }
+
+  conn->probe_us = now + conn->rtt.rto_us;
+  arm_timer(conn->shard, conn->probe_us);
+}
+
+/* Backend only: the peer echoed a probe, so its size crosses the path */
+static void pmtu_probe_acked(rudp_conn_t* conn, int seqnum) {
+  if (conn->probe_size == 0 || seqnum != conn->probe_seq) {
+    return;
+  }
+
+  pthread_mutex_lock(&conn->lock);
+  conn->plpmtu = conn->probe_size;
+  pthread_mutex_unlock(&conn->lock);
+
+  conn->probe_size = 0;
+  pmtu_probe(conn, now_us());
+}
+
+/*
+ * Backend only: back-to-back timeouts may mean the path now drops what used
+ * to fit, so drop to the base size and search again.
+ */
+static void pmtu_black_hole(rudp_conn_t* conn, long long now) {
+  if (conn->plpmtu == RUDP_MAX_PAYLOAD) {
+    return;
+  }
+
+  pthread_mutex_lock(&conn->lock);
+  conn->plpmtu = RUDP_MAX_PAYLOAD;
+  conn->stats.pmtu_black_holes = conn->stats.pmtu_black_holes + 1;
+  pthread_mutex_unlock(&conn->lock);
+
+  conn->pmtu_ceiling = conn->mss;
+  conn->probe_size = 0;
+  conn->probe_us = now + conn->rtt.rto_us;
+  arm_timer(conn->shard, conn->probe_us);
+}
+
+/*
+ * Sends as much as the congestion and peer windows and the pacer allow:
+ * packets marked lost first, then queued packets not yet sent.
+ */
+static void service_send(rudp_conn_t* conn) {
+  pthread_mutex_lock(&conn->lock);
+
+  /*
+   * Entries are only ever appended by queue_packet and only removed by
+   * this thread, so the snapshot below stays valid once the lock is dropped.
+   */
+  int last = conn->count;
+  int base = conn->head;
+  int seq_base = conn->send_seqnum;
+  int pipe = conn->in_flight - conn->nsacked - conn->nlost;
+  int budget = rudp_cc_window(&conn->cc) - pipe;
+  double rate = pacing_rate(conn);
+  int packet = full_packet(conn);
+  conn->stats.pacing_rate = (unsigned long)rate;
+  conn->fec_group = fec_group_size(conn->fec_mode, conn->loss_rate);
+
+  pthread_mutex_unlock(&conn->lock);
+
+  long long now = now_us();
+  if (rate > 0) {
+    pace_refill(conn, rate, packet, now);
+  }
+
+  swnd_entry_t* batch[RUDP_BATCH];
+  int n = 0;
+  int stalled = 0;
+  int paced = 0;
+  int in_flight = conn->in_flight;
+  int lost = conn->nlost;
+
+  for (int i = 0; i < in_flight && lost > 0 && budget > 0 && stalled == 0; i++) {
+    swnd_entry_t* entry = &conn->send_window[(base + i) % conn->swnd_size];
+    if (entry->lost == 0) {
+      continue;
+    }
+    if (pace_take(conn, rate, entry) == 0) {
+      paced = 1;
+      break;
+    }
+    lost = lost - 1;
+    budget = budget - 1;
+    stalled = batch_add(conn, batch, &n, entry);
+  }
+
+  for (int i = in_flight; i < last && seq_base + i < conn->peer_edge && budget > 0 &&
+                          stalled == 0 && paced == 0; i++) {
+    swnd_entry_t* entry = &conn->send_window[(base + i) % conn->swnd_size];
+    if (pace_take(conn, rate, entry) == 0) {
+      paced = 1;
+      break;
+    }
+    budget = budget - 1;
+    stalled = batch_add(conn, batch, &n, entry);
+  }
+
+  if (n > 0 && stalled == 0) {
+    transmit_batch(conn, batch, n);
+  }
+
+  /* Come back when the bucket holds a full packet again */
+  int waiting = (conn->pace_us != 0);
+  conn->pace_us = 0;
+  if (paced && stalled == 0) {
+    conn->pace_us = now + (long long)((packet - conn->pace_tokens) * 1e6 / rate) + 1;
+    arm_timer(conn->shard, conn->pace_us);
+
+    if (waiting == 0) {
+      pthread_mutex_lock(&conn->lock);
+      conn->stats.pacing_waits = conn->stats.pacing_waits + 1;
+      pthread_mutex_unlock(&conn->lock);
+    }
+  }
+
+  if (conn->in_flight > 0) {
+    arm_timer(conn->shard, conn->send_window[conn->head].sent_us + conn->rtt.rto_us);
+  }
+  arm_tail_probe(conn);
+
+  /*
+   * Nothing left to be ACKed, so no ACK will reopen the window: probe until
+   * the peer's update arrives in case the one it sends on its own is lost.
+   */
+  if (conn->in_flight == 0 && last > 0 && seq_base >= conn->peer_edge) {
+    if (conn->persist_us == 0) {
+      conn->persist_backoff = 0;
+      conn->persist_us = now_us() + conn->rtt.rto_us;
+      arm_timer(conn->shard, conn->persist_us);
+    }
+  } else {
+    conn->persist_us = 0;
+  }
+
+  /* Everything queued is out; don't hold a partial group's parity back */
+  if (conn->fec_count > 0 && conn->in_flight >= last) {
+    fec_flush(conn, now_us());
+  }
+
+  /* Path MTU discovery starts with the first data to send */
+  if (conn->probe_us == 0 && last > 0) {
+    pmtu_probe(conn, now_us());
+  }
+}
+
+/* A zero-length DAT below the cumulative ACK, which the peer answers with an ACK */
+static void send_window_probe(rudp_conn_t* conn) {
+  char buf[sizeof(rudp_packet_t) + RUDP_CRC_LEN];
+  rudp_packet_t* probe = (rudp_packet_t*)buf;
+  memset(probe, 0, sizeof(rudp_packet_t));
+  probe->type = DAT;
+  probe->seqnum = conn->send_seqnum - 1;
+
+  int len = crc_seal(conn, buf, sizeof(rudp_packet_t));
+  if (sendto(conn->socket, buf, len, 0,
+             (struct sockaddr*)&conn->peer, conn->peerlen) >= 0) {
+    count_io(conn, 1, 1);
+  }
+}
+
+/* Backend only: an empty PRB, which the peer echoes even with nothing to ACK */
+static void send_keepalive(rudp_conn_t* conn) {
+  char buf[sizeof(rudp_packet_t) + RUDP_CRC_LEN];
+  rudp_packet_t* probe = (rudp_packet_t*)buf;
+  memset(probe, 0, sizeof(rudp_packet_t));
+  probe->type = PRB;
+
+  int len = crc_seal(conn, buf, sizeof(rudp_packet_t));
+  if (sendto(conn->socket, buf, len, 0,
+             (struct sockaddr*)&conn->peer, conn->peerlen) >= 0) {
+    count_io(conn, 1, 1);
+  }
+
+  pthread_mutex_lock(&conn->lock);
+  conn->stats.keepalives_sent = conn->stats.keepalives_sent + 1;
+  pthread_mutex_unlock(&conn->lock);
+}
+
+/*
+ * Backend only: gives up a silent peer.  Everything the connection buffers
+ * is freed now and every waiter fails with ETIMEDOUT; the socket and the
+ * block itself stay until the application closes the descriptor.
+ */
+static void conn_dead(rudp_conn_t* conn) {
+  epoll_ctl(conn->shard->epoll_fd, EPOLL_CTL_DEL, conn->socket, NULL);
+
+  pthread_mutex_lock(&conn->lock);
+  conn->dead = 1;
+  conn->stats.dead = 1;
+
+  for (int i = 0; i < conn->count; i++) {
+    swnd_entry_t* entry = &conn->send_window[(conn->head + i) % conn->swnd_size];
+    if (entry->payload != NULL) {
+      pool_put(conn, entry->payload);
+    }
+  }
+  conn->count = 0;
+  conn->in_flight = 0;
+  conn->nsacked = 0;
+  conn->nlost = 0;
+  conn->rq_count = 0;
+  conn->rq_ooo = 0;
+
+  /* A buffer still on loan keeps the pool until the connection is freed */
+  if (conn->pool.nfree == conn->pool.size) {
+    pool_destroy(&conn->pool);
+    memset(&conn->pool, 0, sizeof(conn->pool));
+  }
+  free(conn->send_window);
+  conn->send_window = NULL;
+  free(conn->recv_queue);
+  conn->recv_queue = NULL;
+  free(conn->rq_bufs);
+  conn->rq_bufs = NULL;
+  free(conn->fec_tx);
+  conn->fec_tx = NULL;
+  free(conn->fec_rx);
+  conn->fec_rx = NULL;
+  free(conn->lz_rx);
+  conn->lz_rx = NULL;
+  for (int i = 0; conn->streams != NULL && i < RUDP_STREAMS_MAX; i++) {
+    stream_free(&conn->streams[i]);
   }
 
-  int idx = head;
-  int total_size = sizeof(rudp_packet_t) + len;
+  pthread_cond_broadcast(&conn->cond);
+  pthread_cond_broadcast(&conn->recv_cond);
+  pthread_mutex_unlock(&conn->lock);
+}
 
-  send_window[idx].packet = (rudp_packet_t*)malloc(total_size);
+/*
+ * Backend only: the next liveness deadline, 0 if none.  A peer that has
+ * finished sending, with nothing of ours left to deliver, owes us nothing.
+ */
+static long long liveness_deadline(rudp_conn_t* conn) {
+  pthread_mutex_lock(&conn->lock);
+  int keepalive = conn->keepalive_ms;
+  int idle = conn->idle_timeout_ms;
+  int finished = conn->peer_fin && conn->count == 0;
+  pthread_mutex_unlock(&conn->lock);
 
-  if (send_window[idx].packet == NULL) {
-    pthread_mutex_unlock(&send_window_lock);
-    return;
+  if (finished) {
+    return 0;
+  }
+
+  long long deadline = 0;
+  if (idle > 0) {
+    deadline = conn->heard_us + (long long)idle * 1000;
+  }
+  if (keepalive > 0) {
+    long long last = (conn->keepalive_us > conn->heard_us) ? conn->keepalive_us : conn->heard_us;
+    long long due = last + (long long)keepalive * 1000;
+    if (deadline == 0 || due < deadline) {
+      deadline = due;
+    }
+  }
+  return deadline;
+}
+
+/* Backend only: probes or gives up a silent peer; -1 once it is dead */
+static long long service_liveness(rudp_conn_t* conn, long long now) {
+  pthread_mutex_lock(&conn->lock);
+  int keepalive = conn->keepalive_ms;
+  int idle = conn->idle_timeout_ms;
+  int finished = conn->peer_fin && conn->count == 0;
+  pthread_mutex_unlock(&conn->lock);
+
+  if (finished) {
+    return 0;
   }
 
-  send_window[idx].packet->type = DAT;
-  memcpy(send_window[idx].packet->payload, buf, len);
+  long long silence = now - conn->heard_us;
+  if (idle > 0 && silence >= (long long)idle * 1000) {
+    conn_dead(conn);
+    return -1;
+  }
 
-  send_window[idx].socket = sock;
-  send_window[idx].packetlen = total_size;
+  long long last = (conn->keepalive_us > conn->heard_us) ? conn->keepalive_us : conn->heard_us;
+  if (keepalive > 0 && now >= last + (long long)keepalive * 1000) {
+    send_keepalive(conn);
+    conn->keepalive_us = now;
+  }
+  return liveness_deadline(conn);
+}
 
-  count = count + 1;
+/* Marks every in-flight packet the peer has not reported as lost */
+static void mark_unsacked_lost(rudp_conn_t* conn) {
+  for (int i = 0; i < conn->in_flight; i++) {
+    swnd_entry_t* entry = &conn->send_window[(conn->head + i) % conn->swnd_size];
+    if (entry->sacked == 0 && entry->lost == 0) {
+      entry->lost = 1;
+      conn->nlost = conn->nlost + 1;
+    }
+  }
+}
 
-  pthread_mutex_unlock(&send_window_lock);
+/* Receive ring slot for `seqnum`, or NULL if it lies outside the buffer */
+static rq_entry_t* rq_slot(rudp_conn_t* conn, int seqnum) {
+  int offset = seqnum - (conn->recv_seqnum - conn->rq_count);
+  if (offset < 0 || offset >= (int)conn->rq_size) {
+    return NULL;
+  }
+  return &conn->recv_queue[(conn->rq_head + offset) % conn->rq_size];
 }
 
-static void dequeue_packet(void) {
-  pthread_mutex_lock(&send_window_lock);
+static int rq_has(rudp_conn_t* conn, int seqnum) {
+  rq_entry_t* slot = rq_slot(conn, seqnum);
+  return slot != NULL && slot->valid;
+}
 
-  if (send_window[head].packet != NULL) {
-    free(send_window[head].packet);
-    send_window[head].packet = NULL;
+/* Extends `seqnum` to the run of buffered packets around it */
+static rudp_sack_t sack_run(rudp_conn_t* conn, int seqnum) {
+  rudp_sack_t run = { seqnum, seqnum };
+  while (rq_has(conn, run.start - 1) && run.start - 1 > conn->recv_seqnum) {
+    run.start = run.start - 1;
+  }
+  while (rq_has(conn, run.end + 1)) {
+    run.end = run.end + 1;
   }
+  return run;
+}
+
+/*
+ * Caller holds conn->lock.  Builds a cumulative ACK into `buf` with SACK
+ * blocks for what sits beyond the gap; the block around `trigger` (the
+ * packet that caused this ACK) goes first.  Returns the datagram length.
+ */
+static int build_ack(rudp_conn_t* conn, int trigger, int delay_us, char* buf) {
+  rudp_packet_t* ack_pkt = (rudp_packet_t*)buf;
+  memset(ack_pkt, 0, sizeof(rudp_packet_t));
+  ack_pkt->type = ACK;
+  ack_pkt->seqnum = conn->recv_seqnum - 1;
+  ack_pkt->window = conn->rq_size - conn->rq_count;
+  conn->rwnd_closed = (ack_pkt->window == 0);
 
-  count = count - 1;
+  rudp_sack_t blocks[RUDP_SACK_MAX];
+  int nblocks = 0;
+
+  if (trigger > conn->recv_seqnum && rq_has(conn, trigger)) {
+    blocks[nblocks++] = sack_run(conn, trigger);
+  }
 
-  pthread_cond_signal(&send_window_cond);
+  int limit = conn->recv_seqnum - conn->rq_count + (int)conn->rq_size;
+  for (int seq = conn->recv_seqnum + 1; seq < limit && nblocks < RUDP_SACK_MAX; seq++) {
+    if (rq_has(conn, seq) == 0) {
+      continue;
+    }
+    rudp_sack_t run = sack_run(conn, seq);
+    if (nblocks == 0 || run.start != blocks[0].start) {
+      blocks[nblocks++] = run;
+    }
+    seq = run.end;
+  }
 
-  pthread_mutex_unlock(&send_window_lock);
+  memcpy(ack_pkt->payload + offsetof(rudp_ack_t, delay_us), &delay_us, sizeof(delay_us));
+  memcpy(ack_pkt->payload + offsetof(rudp_ack_t, sacks), blocks, nblocks * sizeof(rudp_sack_t));
+  return sizeof(rudp_packet_t) + sizeof(rudp_ack_t) + nblocks * sizeof(rudp_sack_t);
 }
 
-void* rudp_backend(void* unused) {
-  int malloc_size = sizeof(swnd_entry_t) * swnd_size;
-  send_window = malloc(malloc_size);
+/* Builds an ACK covering everything received so far, cancelling any delayed one */
+static int prepare_ack(rudp_conn_t* conn, int trigger, int delay_us, char* buf) {
+  conn->ack_pending = 0;
+  conn->ack_due_us = 0;
 
-  while (1) {
-    pthread_mutex_lock(&send_window_lock);
+  pthread_mutex_lock(&conn->lock);
+  int ack_len = build_ack(conn, trigger, delay_us, buf);
+  conn->stats.acks_sent = conn->stats.acks_sent + 1;
+  pthread_mutex_unlock(&conn->lock);
+  return ack_len;
+}
+
+static void send_ack(rudp_conn_t* conn, int trigger, int delay_us) {
+  char ack_buf[RUDP_ACK_MAX];
+  int ack_len = crc_seal(conn, ack_buf, prepare_ack(conn, trigger, delay_us, ack_buf));
 
-    int has_packet = (count > 0 && send_window[head].packet != NULL) ? 1 : 0;
+  if (sendto(conn->socket, ack_buf, ack_len, 0,
+             (struct sockaddr*)&conn->peer, conn->peerlen) >= 0) {
+    count_io(conn, 1, 1);
+  }
+}
 
-    if (has_packet == 1) {
-      int sock = send_window[head].socket;
-      rudp_packet_t* pkt = send_window[head].packet;
-      int len = send_window[head].packetlen;
+/*
+ * Caller holds conn->lock.  Hands a newly arrived STM packet to its stream,
+ * in or out of the connection's order.  A first packet on a stream the
+ * peer opened creates it, and every lower-numbered one it has not seen.
+ * Returns -1 to refuse the packet, unACKed, when the stream table is full
+ * or it runs past the credit; stragglers for closed streams are taken and
+ * dropped.
+ */
+static int stream_arrival(rudp_conn_t* conn, rudp_packet_t* pkt, int payload_len) {
+  rudp_stm_t hdr;
+  if (payload_len < (int)sizeof(hdr)) {
+    return 0;
+  }
+  memcpy(&hdr, pkt->payload, sizeof(hdr));
 
-      pthread_mutex_unlock(&send_window_lock);
+  int peer_opened = (hdr.flags & RUDP_STM_OPENER) != 0;
+  int handle = hdr.stream * 2 + peer_opened;
+  rudp_stream_t* st = stream_find(conn, handle);
+  if (st == NULL) {
+    if (peer_opened == 0 || hdr.stream <= conn->stream_peer_max) {
+      return 0;
+    }
+    while (conn->stream_peer_max < hdr.stream) {
+      if (stream_new(conn, (conn->stream_peer_max + 1) * 2 + 1) == NULL) {
+        return -1;
+      }
+      conn->stream_peer_max = conn->stream_peer_max + 1;
+    }
+    st = stream_find(conn, handle);
+    pthread_cond_broadcast(&conn->recv_cond);
+  }
 
-      pkt->seqnum = send_seqnum;
+  if (hdr.flags & RUDP_STM_CREDIT) {
+    if (hdr.seq > st->send_limit) {
+      st->send_limit = hdr.seq;
+      pthread_cond_broadcast(&st->send_cond);
+    }
+    return 0;
+  }
 
-      ssize_t sent_bytes = sendto(sock, (void*)pkt, len, 0, NULL, 0);
+  int offset = hdr.seq - st->recv_seq;
+  if (offset < 0 || st->recv_closed) {
+    return 0;
+  }
+  if (offset >= RUDP_STREAM_WINDOW) {
+    return -1;
+  }
 
-      if (sent_bytes < 0) {
-        usleep(10000);
-        continue;
+  int idx = hdr.seq % RUDP_STREAM_WINDOW;
+  if (st->lens[idx] >= 0) {
+    return 0;
+  }
+  int len = payload_len - (int)sizeof(hdr);
+  memcpy(st->bufs + (size_t)idx * conn->mss, pkt->payload + sizeof(hdr), len);
+  st->lens[idx] = len;
+  st->fins[idx] = (hdr.flags & RUDP_STM_FIN) != 0;
+  if (offset == 0) {
+    pthread_cond_broadcast(&st->recv_cond);
+  }
+  return 0;
+}
+
+/*
+ * Stores a DAT or FIN packet in its receive slot if it fits in the buffer,
+ * and moves recv_seqnum past whatever is now contiguous.  Returns nonzero
+ * if the packet must be ACKed right away: it is a FIN, was out of order, a
+ * duplicate, filled or sits next to a gap, or completes a group of
+ * ack_every.  Once the application has closed the socket nobody reads the
+ * queue, so in-order packets are consumed on arrival.
+ */
+static int deliver_packet(rudp_conn_t* conn, rudp_packet_t* pkt, int payload_len) {
+  pthread_mutex_lock(&conn->lock);
+
+  int depth = pkt->seqnum - conn->recv_seqnum;
+  int in_order = (depth == 0);
+  rq_entry_t* slot = NULL;
+  if (depth >= 0) {
+    slot = rq_slot(conn, pkt->seqnum);
+  }
+
+  if ((depth < 0 && payload_len > 0) || (slot != NULL && slot->valid)) {
+    conn->stats.dup_packets = conn->stats.dup_packets + 1;
+    slot = NULL;
+  } else if (slot != NULL && depth > 0) {
+    /* Held until the gap fills; past the bound the sender has to resend it */
+    if (conn->rq_ooo >= conn->reorder_max) {
+      conn->stats.reorder_dropped = conn->stats.reorder_dropped + 1;
+      slot = NULL;
+    } else {
+      conn->stats.reorder_packets = conn->stats.reorder_packets + 1;
+      conn->stats.reorder_depth_total = conn->stats.reorder_depth_total + depth;
+      if ((unsigned int)depth > conn->stats.reorder_depth_max) {
+        conn->stats.reorder_depth_max = depth;
       }
+    }
+  }
 
-      struct timeval timeout;
-      timeout.tv_sec = 0;
-      timeout.tv_usec = 100000;
+  if (slot != NULL && pkt->type == STM && stream_arrival(conn, pkt, payload_len) != 0) {
+    slot = NULL;
+  }
 
-      int opt_result = setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-      if (opt_result < 0) {
-        usleep(10000);
-        continue;
+  if (slot != NULL) {
+    slot->seqnum = pkt->seqnum;
+    slot->streamed = (pkt->type == STM);
+    slot->fin = (pkt->type == FIN);
+    slot->lz = (pkt->type == DAT && (pkt->flags & RUDP_HDR_LZ));
+    if (slot->fin) {
+      payload_len = 0;
+    }
+    memcpy(slot->data, pkt->payload, payload_len);
+    slot->len = payload_len;
+    slot->valid = 1;
+    if (in_order == 0) {
+      conn->rq_ooo = conn->rq_ooo + 1;
+    }
+
+    int ready = conn->rq_count;
+    while (rq_has(conn, conn->recv_seqnum)) {
+      if (rq_slot(conn, conn->recv_seqnum)->fin) {
+        conn->peer_fin = 1;
+        /* Streams the peer never ended won't get any more data either */
+        for (int i = 0; conn->streams != NULL && i < RUDP_STREAMS_MAX; i++) {
+          pthread_cond_broadcast(&conn->streams[i].recv_cond);
+        }
+      }
+      conn->recv_seqnum = conn->recv_seqnum + 1;
+      conn->rq_count = conn->rq_count + 1;
+    }
+    if (conn->rq_count > ready) {
+      conn->rq_ooo = conn->rq_ooo - (conn->rq_count - ready - 1);
+      pthread_cond_broadcast(&conn->recv_cond);
+    }
+    rq_pop_streamed(conn);
+    if (conn->closed) {
+      while (conn->rq_count > 0) {
+        conn->recv_queue[conn->rq_head].valid = 0;
+        conn->rq_head = (conn->rq_head + 1) % conn->rq_size;
+        conn->rq_count = conn->rq_count - 1;
+      }
+    }
+  } else {
+    in_order = 0;
+  }
+
+  int ack_now = 1;
+  if (in_order && (pkt->type == DAT || pkt->type == STM) && conn->rq_ooo == 0 &&
+      conn->recv_seqnum == pkt->seqnum + 1) {
+    conn->ack_pending = conn->ack_pending + 1;
+    ack_now = (conn->ack_pending >= conn->ack_every);
+  }
+
+  pthread_mutex_unlock(&conn->lock);
+  return ack_now;
+}
+
+/*
+ * Caller holds conn->lock.  The slot still holding `seqnum`'s payload: not
+ * yet delivered, or delivered but not yet overwritten.
+ */
+static rq_entry_t* rq_held(rudp_conn_t* conn, int seqnum) {
+  int offset = seqnum - (conn->recv_seqnum - conn->rq_count);
+  if (offset >= (int)conn->rq_size || offset <= -(int)conn->rq_size) {
+    return NULL;
+  }
+
+  rq_entry_t* slot = &conn->recv_queue[(conn->rq_head + offset + conn->rq_size) % conn->rq_size];
+  if (slot->seqnum != seqnum || slot->fin) {
+    return NULL;
+  }
+  if (seqnum >= conn->recv_seqnum && slot->valid == 0) {
+    return NULL;
+  }
+  return slot;
+}
+
+/*
+ * Rebuilds the one packet of a parity group that is missing, if every
+ * other member is still in the receive ring, and delivers it as if it had
+ * arrived.  Returns the length of the ACK|FEC built into `ack_buf` that
+ * reports it, or 0.
+ */
+static int fec_recover(rudp_conn_t* conn, rudp_packet_t* pkt, int payload_len, char* ack_buf) {
+  int start = pkt->seqnum;
+  int count = pkt->window;
+  int parity_len = payload_len - (int)sizeof(rudp_fec_t);
+  if (parity_len < 0 || count < 1 || count > RUDP_FEC_MAX) {
+    return 0;
+  }
+  if (conn->fec_rx == NULL) {
+    conn->fec_rx = malloc(sizeof(rudp_packet_t) + conn->mss);
+    if (conn->fec_rx == NULL) {
+      return 0;
+    }
+  }
+
+  rudp_fec_t* fec = (rudp_fec_t*)pkt->payload;
+  rudp_packet_t* rebuilt = (rudp_packet_t*)conn->fec_rx;
+  int len;
+  memcpy(&len, &fec->len_xor, sizeof(len));
+
+  pthread_mutex_lock(&conn->lock);
+
+  int missing = -1;
+  for (int seq = start; seq < start + count; seq++) {
+    if (rq_held(conn, seq) != NULL) {
+      continue;
+    }
+    /* Two gone, or one already handed over without being kept */
+    if (missing != -1 || seq < conn->recv_seqnum || rq_slot(conn, seq) == NULL) {
+      pthread_mutex_unlock(&conn->lock);
+      return 0;
+    }
+    missing = seq;
+  }
+  if (missing == -1) {
+    pthread_mutex_unlock(&conn->lock);
+    return 0;
+  }
+
+  memcpy(rebuilt->payload, fec->parity, parity_len);
+  for (int seq = start; seq < start + count; seq++) {
+    rq_entry_t* slot = rq_held(conn, seq);
+    if (slot == NULL) {
+      continue;
+    }
+    if (slot->len > parity_len) {
+      pthread_mutex_unlock(&conn->lock);
+      return 0;
+    }
+    len = len ^ slot->len ^ (slot->lz ? RUDP_FEC_LZ : 0);
+    xor_bytes(rebuilt->payload, slot->data, slot->len);
+  }
+
+  pthread_mutex_unlock(&conn->lock);
+
+  int lz = (len & RUDP_FEC_LZ) != 0;
+  len = len & ~RUDP_FEC_LZ;
+  if (len < 0 || len > parity_len) {
+    return 0;
+  }
+
+  memset(rebuilt, 0, sizeof(rudp_packet_t));
+  rebuilt->type = DAT;
+  rebuilt->flags = lz ? RUDP_HDR_LZ : 0;
+  rebuilt->seqnum = missing;
+  deliver_packet(conn, rebuilt, len);
+
+  pthread_mutex_lock(&conn->lock);
+  int recovered = (rq_held(conn, missing) != NULL);
+  if (recovered) {
+    conn->stats.fec_recovered = conn->stats.fec_recovered + 1;
+  }
+  pthread_mutex_unlock(&conn->lock);
+
+  if (recovered == 0) {
+    return 0;
+  }
+  int ack_len = prepare_ack(conn, missing, 0, ack_buf);
+  ((rudp_packet_t*)ack_buf)->type = ACK | FEC;
+  return ack_len;
+}
+
+/* Answers a retransmitted SYN: our SYN|ACK, or the data it carried, was lost */
+static int build_syn_ack(rudp_conn_t* conn, char* buf) {
+  rudp_syn_packet_t* reply = (rudp_syn_packet_t*)buf;
+  memset(reply, 0, sizeof(rudp_syn_packet_t));
+  reply->hdr.type = SYN | ACK;
+  reply->hdr.window = RUDP_RWND_SIZE;
+  reply->syn.mss = conn->mss;
+  if (conn->fastopen) {
+    reply->syn.flags = RUDP_SYN_DATA_ACKED;
+  }
+  if (conn->crc) {
+    reply->syn.flags = reply->syn.flags | RUDP_SYN_CRC;
+  }
+  if (conn->lz) {
+    reply->syn.flags = reply->syn.flags | RUDP_SYN_LZ;
+  }
+  return sizeof(rudp_syn_packet_t);
+}
+
+/* Echoes a PMTU probe's seqnum back to the prober */
+static int build_probe_ack(int seqnum, char* buf) {
+  rudp_packet_t* reply = (rudp_packet_t*)buf;
+  memset(reply, 0, sizeof(rudp_packet_t));
+  reply->type = PRB | ACK;
+  reply->seqnum = seqnum;
+  return sizeof(rudp_packet_t);
+}
+
+/*
+ * Backend only: when a closed connection may be freed.  After the linger
+ * time at the latest, but once the peer's FIN is in, RUDP_TIME_WAIT_US past
+ * its last copy, in case our ACK of it was lost and it comes again.
+ */
+static long long close_deadline(rudp_conn_t* conn) {
+  long long deadline = conn->close_us;
+  if (conn->fin_rx_us != 0) {
+    long long done_us = conn->fin_rx_us + RUDP_TIME_WAIT_US;
+    if (done_us < deadline) {
+      deadline = done_us;
+    }
+  }
+  return deadline;
+}
+
+/*
+ * Handles one datagram from the peer.  Returns the length of the ACK it
+ * built into `ack_buf` if it needs an immediate one, otherwise 0; sets
+ * `*acked` if it was an ACK that told us something new.
+ */
+static int service_packet(rudp_conn_t* conn, char* buf, int len, char* ack_buf, int* acked) {
+  if (len < (int)sizeof(rudp_packet_t)) {
+    return 0;
+  }
+
+  rudp_packet_t* pkt = (rudp_packet_t*)buf;
+  int payload_len = len - sizeof(rudp_packet_t);
+  int trigger;
+
+  /* Whatever data a SYN carries was taken, or not, by sans_accept */
+  if (pkt->type == SYN) {
+    return build_syn_ack(conn, ack_buf);
+  }
+
+  /* Nothing we agreed to; it would not fit a receive slot */
+  if (payload_len > conn->mss + (pkt->type == FEC ? (int)sizeof(rudp_fec_t) : 0)) {
+    return 0;
+  }
+
+  if (pkt->type == ACK || pkt->type == (ACK | FEC)) {
+    if (process_ack(conn, pkt, payload_len)) {
+      *acked = 1;
+    }
+    return 0;
+  } else if (pkt->type == DAT || pkt->type == FIN || pkt->type == STM) {
+    if (deliver_packet(conn, pkt, payload_len) == 0) {
+      conn->ack_rx_us = now_us();
+      return 0;
+    }
+    if (pkt->type == FIN && conn->peer_fin) {
+      conn->fin_rx_us = now_us();
+    }
+    trigger = pkt->seqnum;
+  } else if (pkt->type == (SYN | ACK)) {
+    /* Our handshake ACK was lost and the peer is still waiting on it */
+    trigger = conn->recv_seqnum - 1;
+  } else if (pkt->type == FEC) {
+    return fec_recover(conn, pkt, payload_len, ack_buf);
+  } else if (pkt->type == PRB) {
+    return build_probe_ack(pkt->seqnum, ack_buf);
+  } else if (pkt->type == (PRB | ACK)) {
+    pmtu_probe_acked(conn, pkt->seqnum);
+    return 0;
+  } else {
+    return 0;
+  }
+
+  return prepare_ack(conn, trigger, 0, ack_buf);
+}
+
+/* Segment size of a coalesced UDP_GRO read, or `len` for a single datagram */
+static int gro_segment(struct msghdr* hdr, int len) {
+  for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+    if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+      int size;
+      memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+      if (size > 0) {
+        return size;
       }
+    }
+  }
+  return len;
+}
+
+/*
+ * Drains every datagram waiting on the connection's socket, RUDP_BATCH
+ * reads per recvmmsg, and answers the DAT packets with sendmmsg batches of
+ * ACKs.  With UDP GRO a read may hold many datagrams the kernel coalesced,
+ * so it is split on the segment size it reports.
+ */
+static void service_recv(rudp_conn_t* conn) {
+  if (conn->dead) {
+    return;  /* an event from before conn_dead() in this batch */
+  }
+
+  char* rx_bufs = conn->shard->rx_bufs;
+  int slot = conn->gro ? RUDP_GRO_BUF : (int)(sizeof(rudp_header_t) + sizeof(rudp_fec_t)) + conn->mss + RUDP_CRC_LEN;
+  slot = (slot + RUDP_RX_ALIGN - 1) & ~(RUDP_RX_ALIGN - 1);
+  int nslots = RUDP_RX_BYTES / slot;
+  if (nslots > RUDP_BATCH) {
+    nslots = RUDP_BATCH;
+  }
 
-      while (1) {
-        char ack_buf[256];
-        struct sockaddr_storage src_addr;
-        socklen_t src_len = sizeof(src_addr);
+  struct iovec pkt_iov[RUDP_BATCH];
+  struct mmsghdr msgs[RUDP_BATCH];
+  char ctrl[RUDP_BATCH][CMSG_SPACE(sizeof(int))];
+  char ack_bufs[RUDP_BATCH][RUDP_ACK_MAX];
+  struct iovec ack_iov[RUDP_BATCH];
+  int acked = 0;
 
-        ssize_t recv_bytes = recvfrom(sock, ack_buf, sizeof(ack_buf), 0,
-                                       (struct sockaddr*)&src_addr, &src_len);
+  while (1) {
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < nslots; i++) {
+      pkt_iov[i].iov_base = rx_bufs + (size_t)i * slot;
+      pkt_iov[i].iov_len = slot;
+      msgs[i].msg_hdr.msg_iov = &pkt_iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      if (conn->gro) {
+        msgs[i].msg_hdr.msg_control = ctrl[i];
+        msgs[i].msg_hdr.msg_controllen = sizeof(ctrl[i]);
+      }
+    }
+
+    int n = recvmmsg(conn->socket, msgs, nslots, MSG_DONTWAIT, NULL);
+    if (n <= 0) {
+      break;
+    }
+    conn->heard_us = now_us();
 
-        if (recv_bytes > 0) {
-          rudp_packet_t* ack_pkt = (rudp_packet_t*)ack_buf;
+    int npkts = 0;
+    int nacks = 0;
+    int corrupt = 0;
+    for (int i = 0; i < n; i++) {
+      char* buf = pkt_iov[i].iov_base;
+      int len = msgs[i].msg_len;
+      int seg = gro_segment(&msgs[i].msg_hdr, len);
 
-          int is_ack = (ack_pkt->type == ACK) ? 1 : 0;
-          int seqnum_match = (ack_pkt->seqnum == send_seqnum) ? 1 : 0;
+      for (int off = 0; off < len; off = off + seg) {
+        int seg_len = (len - off < seg) ? len - off : seg;
+        char* pkt = buf + off;
+        npkts = npkts + 1;
 
-          if (is_ack == 1 && seqnum_match == 1) {
-            send_seqnum = send_seqnum + 1;
-            dequeue_packet();
-            break;
-          }
-        } else {
-          break;
+        /* Segments of a size that isn't a multiple of it leave the next ones misaligned */
+        if ((uintptr_t)pkt % RUDP_RX_ALIGN != 0) {
+          memcpy(conn->shard->rx_align, pkt, seg_len);
+          pkt = conn->shard->rx_align;
+        }
+        if (crc_check(conn, pkt, &seg_len) != 0) {
+          corrupt = corrupt + 1;
+          continue;
+        }
+        int ack_len = service_packet(conn, pkt, seg_len, ack_bufs[nacks], &acked);
+        if (ack_len == 0) {
+          continue;
+        }
+        ack_len = crc_seal(conn, ack_bufs[nacks], ack_len);
+        ack_iov[nacks].iov_base = ack_bufs[nacks];
+        ack_iov[nacks].iov_len = ack_len;
+        nacks = nacks + 1;
+        if (nacks == RUDP_BATCH) {
+          (void)send_batch(conn, ack_iov, 1, nacks);
+          nacks = 0;
         }
       }
+    }
+    count_io(conn, 0, npkts);
+
+    if (corrupt > 0) {
+      pthread_mutex_lock(&conn->lock);
+      conn->stats.crc_errors = conn->stats.crc_errors + corrupt;
+      pthread_mutex_unlock(&conn->lock);
+    }
+
+    if (nacks > 0) {
+      (void)send_batch(conn, ack_iov, 1, nacks);
+    }
+
+    if (n < nslots) {
+      break;
+    }
+  }
+
+  /* Whatever the batch left unACKed waits for more data or the timer */
+  if (conn->ack_pending > 0 && conn->ack_due_us == 0) {
+    pthread_mutex_lock(&conn->lock);
+    int delay = conn->ack_delay_us;
+    pthread_mutex_unlock(&conn->lock);
+
+    if (delay == 0) {
+      send_ack(conn, conn->recv_seqnum - 1, 0);
     } else {
-      pthread_mutex_unlock(&send_window_lock);
-      usleep(1000);
+      conn->ack_due_us = conn->ack_rx_us + delay;
+      arm_timer(conn->shard, conn->ack_due_us);
+    }
+  }
+
+  if (acked) {
+    service_send(conn);
+  }
+
+  if (conn_closed(conn)) {
+    arm_timer(conn->shard, close_deadline(conn));
+  }
+}
+
+/* Fires the shard's expired timers and re-arms for the earliest one */
+static void service_timers(rudp_shard_t* shard) {
+  long long now = now_us();
+  long long next = 0;
+
+  shard->timer_armed_us = 0;
+
+  pthread_mutex_lock(&shard->conns_lock);
+  for (rudp_conn_t* conn = shard->conns; conn != NULL; conn = conn->next) {
+    if (conn_closed(conn)) {
+      long long deadline = close_deadline(conn);
+      if (now >= deadline) {
+        conn_kick(conn);
+        continue;
+      }
+      if (next == 0 || deadline < next) {
+        next = deadline;
+      }
+    }
+
+    if (conn->dead) {
+      continue;
+    }
+    long long alive = service_liveness(conn, now);
+    if (alive < 0) {
+      continue;
+    }
+    if (alive != 0 && (next == 0 || alive < next)) {
+      next = alive;
+    }
+
+    if (conn->in_flight > 0 &&
+        now >= conn->send_window[conn->head].sent_us + conn->rtt.rto_us) {
+      /* Back off, shrink cwnd and resend what the peer has not reported */
+      rtt_backoff(&conn->rtt);
+      mark_unsacked_lost(conn);
+      conn->dupacks = 0;
+      conn->tlp_us = 0;
+      /* Losses found while repairing this flight are part of the same event */
+      conn->in_recovery = 1;
+      conn->recover_seq = conn->send_seqnum + conn->in_flight - 1;
+
+      pthread_mutex_lock(&conn->lock);
+      rudp_cc_on_timeout(&conn->cc, now);
+      conn->stats.timeouts = conn->stats.timeouts + 1;
+      pthread_mutex_unlock(&conn->lock);
+
+      if (conn->rtt.backoff >= RUDP_PMTU_BLACK_HOLE) {
+        pmtu_black_hole(conn, now);
+      }
+    }
+
+    if (conn->probe_us != 0 && now >= conn->probe_us) {
+      pmtu_probe(conn, now);
+    }
+
+    /* How late the timer let the pacer be, for rudp_get_stats() */
+    if (conn->pace_us != 0 && now >= conn->pace_us) {
+      unsigned long late = now - conn->pace_us;
+      conn->pace_us = 0;
+
+      pthread_mutex_lock(&conn->lock);
+      conn->stats.pacing_late_us_total = conn->stats.pacing_late_us_total + late;
+      if (late > conn->stats.pacing_late_us_max) {
+        conn->stats.pacing_late_us_max = late;
+      }
+      pthread_mutex_unlock(&conn->lock);
+    }
+
+    pthread_mutex_lock(&conn->lock);
+    int unsent = conn->count - conn->in_flight;
+    pthread_mutex_unlock(&conn->lock);
+
+    if (unsent > 0 || conn->nlost > 0) {
+      service_send(conn);
+    }
+
+    if (conn->persist_us != 0 && now >= conn->persist_us) {
+      send_window_probe(conn);
+      if (conn->persist_backoff < 16) {
+        conn->persist_backoff = conn->persist_backoff + 1;
+      }
+      conn->persist_us = now + clamp_rto(conn->rtt.rto_us << conn->persist_backoff);
+
+      pthread_mutex_lock(&conn->lock);
+      conn->stats.window_probes = conn->stats.window_probes + 1;
+      pthread_mutex_unlock(&conn->lock);
+    }
+
+    if (conn->tlp_us != 0 && now >= conn->tlp_us) {
+      send_tail_probe(conn);
+    }
+
+    if (conn->ack_due_us != 0 && now >= conn->ack_due_us) {
+      send_ack(conn, conn->recv_seqnum - 1, (int)(now - conn->ack_rx_us));
+
+      pthread_mutex_lock(&conn->lock);
+      conn->stats.acks_delayed = conn->stats.acks_delayed + 1;
+      pthread_mutex_unlock(&conn->lock);
+    }
+
+    if (conn->persist_us != 0 && (next == 0 || conn->persist_us < next)) {
+      next = conn->persist_us;
+    }
+    if (conn->tlp_us != 0 && (next == 0 || conn->tlp_us < next)) {
+      next = conn->tlp_us;
+    }
+    if (conn->ack_due_us != 0 && (next == 0 || conn->ack_due_us < next)) {
+      next = conn->ack_due_us;
+    }
+    if (conn->pace_us != 0 && (next == 0 || conn->pace_us < next)) {
+      next = conn->pace_us;
+    }
+    if (conn->probe_us != 0 && (next == 0 || conn->probe_us < next)) {
+      next = conn->probe_us;
+    }
+
+    if (conn->in_flight > 0) {
+      long long deadline = conn->send_window[conn->head].sent_us + conn->rtt.rto_us;
+      if (next == 0 || deadline < next) {
+        next = deadline;
+      }
+    }
+  }
+  pthread_mutex_unlock(&shard->conns_lock);
+
+  if (next != 0) {
+    arm_timer(shard, next);
+  }
+}
+
+static void service_ready(rudp_shard_t* shard) {
+  uint64_t ticks;
+  (void)read(shard->wake_fd, &ticks, sizeof(ticks));
+
+  pthread_mutex_lock(&shard->ready_lock);
+  rudp_conn_t* conn = shard->ready_list;
+  shard->ready_list = NULL;
+  for (rudp_conn_t* c = conn; c != NULL; c = c->ready_next) {
+    c->queued = 0;
+  }
+  pthread_mutex_unlock(&shard->ready_lock);
+
+  while (conn != NULL) {
+    rudp_conn_t* next = conn->ready_next;
+    if (conn_closed(conn)) {
+      long long deadline = close_deadline(conn);
+      if (now_us() >= deadline) {
+        conn_reap(conn);
+      } else {
+        arm_timer(conn->shard, deadline);
+      }
+    } else if (conn->dead == 0) {
+      long long alive = liveness_deadline(conn);
+      if (alive != 0) {
+        arm_timer(conn->shard, alive);
+      }
+
+      pthread_mutex_lock(&conn->lock);
+      int update = conn->wnd_update;
+      conn->wnd_update = 0;
+      pthread_mutex_unlock(&conn->lock);
+
+      if (update) {
+        send_ack(conn, conn->recv_seqnum - 1, 0);
+      }
+      service_send(conn);
+    }
+    conn = next;
+  }
+}
+
+/*
+ * Runs one shard's event loop; `arg` is the shard index cast to a pointer,
+ * so NULL runs shard 0.  Start one thread per rudp_backend_shards().
+ */
+void* rudp_backend(void* arg) {
+  if (init_rudp_backend() != 0) {
+    return NULL;
+  }
+
+  intptr_t index = (intptr_t)arg;
+  if (index < 0 || index >= shard_count) {
+    return NULL;
+  }
+  rudp_shard_t* shard = &shards[index];
+  if (__atomic_exchange_n(&shard->running, 1, __ATOMIC_ACQ_REL) != 0) {
+    return NULL;  /* the shard already has its thread */
+  }
+
+  struct epoll_event events[RUDP_MAX_EVENTS];
+
+  while (1) {
+    int n = epoll_wait(shard->epoll_fd, events, RUDP_MAX_EVENTS, -1);
+    if (n < 0) {
+      continue;
+    }
+
+    int timer_fired = 0;
+    int woken = 0;
+
+    for (int i = 0; i < n; i++) {
+      void* tag = events[i].data.ptr;
+      if (tag == &shard->wake_fd) {
+        woken = 1;
+      } else if (tag == &shard->timer_fd) {
+        timer_fired = 1;
+      } else {
+        service_recv(tag);
+      }
+    }
+
+    /* Reaping happens here, after no event in this batch can name the block */
+    if (woken) {
+      service_ready(shard);
+    }
+
+    if (timer_fired) {
+      uint64_t expirations;
+      (void)read(shard->timer_fd, &expirations, sizeof(expirations));
+      service_timers(shard);
     }
   }
 
   return NULL;
 }
 
-int init_rudp_backend(void) {
+/* The eventfd and timerfd are tagged with the addresses of their fields */
+static int shard_setup(rudp_shard_t* shard) {
+  pthread_mutex_init(&shard->conns_lock, NULL);
+  pthread_mutex_init(&shard->ready_lock, NULL);
+
+  shard->rx_bufs = malloc(RUDP_RX_BYTES);
+  shard->rx_align = malloc(RUDP_GRO_BUF);
+  if (shard->rx_bufs == NULL || shard->rx_align == NULL) {
+    return -1;
+  }
+
+  shard->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  shard->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  shard->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (shard->epoll_fd < 0 || shard->wake_fd < 0 || shard->timer_fd < 0) {
+    return -1;
+  }
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = &shard->wake_fd;
+  if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->wake_fd, &ev) != 0) {
+    return -1;
+  }
+  ev.data.ptr = &shard->timer_fd;
+  if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->timer_fd, &ev) != 0) {
+    return -1;
+  }
   return 0;
 }
+
+static void backend_setup(void) {
+  pthread_mutex_lock(&conns_lock);
+  backend_started = 1;
+  pthread_mutex_unlock(&conns_lock);
+
+  rudp_crc_init();
+
+  for (int i = 0; i < shard_count; i++) {
+    if (shard_setup(&shards[i]) != 0) {
+      return;
+    }
+  }
+
+  backend_status = 0;
+}
+
+int init_rudp_backend(void) {
+  pthread_once(&backend_once, backend_setup);
+  return backend_status;
+}
+
+int rudp_backend_shards(void) {
+  return shard_count;
+}
@@ -0,0 +1,315 @@
+#include <string.h>
+#include <errno.h>
+#include "include/rudp_cc.h"
+#include "include/sans.h"
+
+#ifndef RUDP_CC_INIT_CWND
+#define RUDP_CC_INIT_CWND 10
+#endif
+
+#define RUDP_CC_MIN_CWND 1
+
+/* How long a min RTT sample is trusted before a larger one may replace it */
+#define RUDP_CC_MIN_RTT_WINDOW_US 10000000LL
+
+/* CUBIC constants (RFC 8312) */
+#define CUBIC_C    0.4
+#define CUBIC_BETA 0.7
+
+/*
+ * Default pacing runs ahead of cwnd/RTT, more so in slow start, so the
+ * pacer never becomes the bottleneck (the gains Linux uses).
+ */
+#define PACING_GAIN_SS 2.0
+#define PACING_GAIN_CA 1.2
+
+/* BBR-style model: gains and startup exit rule */
+#define BBR_STARTUP_GAIN      2.89
+#define BBR_CWND_GAIN         2
+#define BBR_FULL_BW_GROWTH    1.25
+#define BBR_FULL_BW_ROUNDS    3
+#define BBR_MIN_CWND          4
+
+enum { BBR_STARTUP, BBR_DRAIN, BBR_PROBE_BW };
+
+static const double bbr_cycle_gain[8] = { 1.25, 0.75, 1, 1, 1, 1, 1, 1 };
+
+static double half_cwnd(const rudp_cc_t* cc, double beta) {
+  double w = cc->cwnd * beta;
+  return w < 2 ? 2 : w;
+}
+
+/* Reno-style AIMD: slow start, then one packet per window per RTT */
+
+static void aimd_init(rudp_cc_t* cc) {
+  (void)cc;
+}
+
+static void aimd_on_ack(rudp_cc_t* cc, int delivered, long long rtt_us, long long now_us) {
+  (void)rtt_us;
+  (void)now_us;
+  if (cc->cwnd < cc->ssthresh) {
+    cc->cwnd = cc->cwnd + delivered;
+  } else {
+    cc->cwnd = cc->cwnd + (double)delivered / cc->cwnd;
+  }
+}
+
+static void aimd_on_loss(rudp_cc_t* cc, long long now_us) {
+  (void)now_us;
+  cc->ssthresh = half_cwnd(cc, 0.5);
+  cc->cwnd = cc->ssthresh;
+}
+
+static void aimd_on_timeout(rudp_cc_t* cc, long long now_us) {
+  (void)now_us;
+  cc->ssthresh = half_cwnd(cc, 0.5);
+  cc->cwnd = RUDP_CC_MIN_CWND;
+}
+
+/* CUBIC: window grows as a cubic function of the time since the last loss */
+
+static double cube_root(double x) {
+  if (x <= 0) {
+    return 0;
+  }
+  double r = x < 1 ? 1 : x;
+  for (int i = 0; i < 64; i++) {
+    double next = (2 * r + x / (r * r)) / 3;
+    if (next >= r) {
+      break;
+    }
+    r = next;
+  }
+  return r;
+}
+
+static void cubic_init(rudp_cc_t* cc) {
+  memset(&cc->u.cubic, 0, sizeof(cc->u.cubic));
+}
+
+static void cubic_on_ack(rudp_cc_t* cc, int delivered, long long rtt_us, long long now_us) {
+  (void)rtt_us;
+  if (cc->cwnd < cc->ssthresh) {
+    cc->cwnd = cc->cwnd + delivered;
+    return;
+  }
+
+  if (cc->u.cubic.epoch_us == 0) {
+    cc->u.cubic.epoch_us = now_us;
+    if (cc->cwnd < cc->u.cubic.w_max) {
+      cc->u.cubic.k = cube_root((cc->u.cubic.w_max - cc->cwnd) / CUBIC_C);
+      cc->u.cubic.origin = cc->u.cubic.w_max;
+    } else {
+      cc->u.cubic.k = 0;
+      cc->u.cubic.origin = cc->cwnd;
+    }
+    cc->u.cubic.w_est = cc->cwnd;
+  }
+
+  double t = (double)(now_us - cc->u.cubic.epoch_us + cc->min_rtt_us) / 1e6 - cc->u.cubic.k;
+  double target = cc->u.cubic.origin + CUBIC_C * t * t * t;
+  if (target > 1.5 * cc->cwnd) {
+    target = 1.5 * cc->cwnd;
+  }
+
+  /* TCP-friendly region: never grow slower than Reno would */
+  cc->u.cubic.w_est = cc->u.cubic.w_est +
+      3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * delivered / cc->cwnd;
+
+  if (target > cc->cwnd) {
+    cc->cwnd = cc->cwnd + (target - cc->cwnd) / cc->cwnd * delivered;
+  } else {
+    cc->cwnd = cc->cwnd + 0.01 * delivered / cc->cwnd;
+  }
+  if (cc->u.cubic.w_est > cc->cwnd) {
+    cc->cwnd = cc->u.cubic.w_est;
+  }
+}
+
+static void cubic_on_loss(rudp_cc_t* cc, long long now_us) {
+  (void)now_us;
+  /* Fast convergence: release bandwidth sooner if the window keeps shrinking */
+  if (cc->cwnd < cc->u.cubic.w_max) {
+    cc->u.cubic.w_max = cc->cwnd * (1 + CUBIC_BETA) / 2;
+  } else {
+    cc->u.cubic.w_max = cc->cwnd;
+  }
+  cc->u.cubic.epoch_us = 0;
+  cc->ssthresh = half_cwnd(cc, CUBIC_BETA);
+  cc->cwnd = cc->ssthresh;
+}
+
+static void cubic_on_timeout(rudp_cc_t* cc, long long now_us) {
+  cubic_on_loss(cc, now_us);
+  cc->cwnd = RUDP_CC_MIN_CWND;
+}
+
+/*
+ * BBR-style: ignores loss and builds a model of the path, the bottleneck
+ * delivery rate (max over recent rounds) and the min RTT.  The pacing rate
+ * follows the rate with a gain that probes up and drains in turn; cwnd
+ * only caps what is in flight at twice the BDP.
+ */
+
+static void bbr_init(rudp_cc_t* cc) {
+  memset(&cc->u.bbr, 0, sizeof(cc->u.bbr));
+  cc->u.bbr.mode = BBR_STARTUP;
+}
+
+static void bbr_end_round(rudp_cc_t* cc, long long now_us) {
+  double sample = (double)(cc->delivered - cc->u.bbr.round_delivered) * 1e6 /
+                  (double)(now_us - cc->u.bbr.round_start_us);
+
+  cc->u.bbr.bw_rounds[cc->u.bbr.round % RUDP_BBR_BW_ROUNDS] = sample;
+  cc->u.bbr.round = cc->u.bbr.round + 1;
+  cc->u.bbr.bw = 0;
+  for (int i = 0; i < RUDP_BBR_BW_ROUNDS; i++) {
+    if (cc->u.bbr.bw_rounds[i] > cc->u.bbr.bw) {
+      cc->u.bbr.bw = cc->u.bbr.bw_rounds[i];
+    }
+  }
+
+  cc->u.bbr.round_start_us = now_us;
+  cc->u.bbr.round_delivered = cc->delivered;
+
+  if (cc->u.bbr.mode == BBR_STARTUP) {
+    /* The pipe is full once the rate stops growing by 25% a round */
+    if (cc->u.bbr.bw >= cc->u.bbr.full_bw * BBR_FULL_BW_GROWTH) {
+      cc->u.bbr.full_bw = cc->u.bbr.bw;
+      cc->u.bbr.full_bw_rounds = 0;
+    } else if (++cc->u.bbr.full_bw_rounds >= BBR_FULL_BW_ROUNDS) {
+      cc->u.bbr.mode = BBR_DRAIN;
+    }
+  } else if (cc->u.bbr.mode == BBR_DRAIN) {
+    cc->u.bbr.mode = BBR_PROBE_BW;
+    cc->u.bbr.cycle = 0;
+  } else {
+    cc->u.bbr.cycle = (cc->u.bbr.cycle + 1) % 8;
+  }
+}
+
+static void bbr_on_ack(rudp_cc_t* cc, int delivered, long long rtt_us, long long now_us) {
+  (void)rtt_us;
+  if (cc->u.bbr.round_start_us == 0) {
+    cc->u.bbr.round_start_us = now_us;
+    cc->u.bbr.round_delivered = cc->delivered;
+  } else if (cc->min_rtt_us > 0 && now_us - cc->u.bbr.round_start_us >= cc->min_rtt_us) {
+    bbr_end_round(cc, now_us);
+  }
+
+  if (cc->u.bbr.mode == BBR_STARTUP || cc->u.bbr.bw == 0) {
+    cc->cwnd = cc->cwnd + delivered;
+    return;
+  }
+
+  double bdp = cc->u.bbr.bw * (double)cc->min_rtt_us / 1e6;
+  cc->cwnd = BBR_CWND_GAIN * bdp;
+  if (cc->cwnd < BBR_MIN_CWND) {
+    cc->cwnd = BBR_MIN_CWND;
+  }
+}
+
+static void bbr_on_loss(rudp_cc_t* cc, long long now_us) {
+  (void)cc;
+  (void)now_us;
+}
+
+static void bbr_on_timeout(rudp_cc_t* cc, long long now_us) {
+  (void)now_us;
+  /* The model survives; the next ACK restores cwnd from it */
+  cc->u.bbr.round_start_us = 0;
+  cc->cwnd = RUDP_CC_MIN_CWND;
+}
+
+static double bbr_pacing_rate(const rudp_cc_t* cc, long long srtt_us) {
+  if (cc->u.bbr.bw == 0) {
+    return BBR_STARTUP_GAIN * cc->cwnd * 1e6 / (double)srtt_us;
+  }
+
+  double gain = bbr_cycle_gain[cc->u.bbr.cycle];
+  if (cc->u.bbr.mode == BBR_STARTUP) {
+    gain = BBR_STARTUP_GAIN;
+  } else if (cc->u.bbr.mode == BBR_DRAIN) {
+    gain = 1 / BBR_STARTUP_GAIN;
+  }
+  return gain * cc->u.bbr.bw;
+}
+
+static const rudp_cc_ops_t cc_algorithms[] = {
+  [RUDP_CC_AIMD]  = { "aimd",  aimd_init,  aimd_on_ack,  aimd_on_loss,  aimd_on_timeout,  NULL },
+  [RUDP_CC_CUBIC] = { "cubic", cubic_init, cubic_on_ack, cubic_on_loss, cubic_on_timeout, NULL },
+  [RUDP_CC_BBR]   = { "bbr",   bbr_init,   bbr_on_ack,   bbr_on_loss,   bbr_on_timeout,   bbr_pacing_rate },
+};
+
+#define CC_ALGORITHM_COUNT ((int)(sizeof(cc_algorithms) / sizeof(cc_algorithms[0])))
+
+int rudp_cc_init(rudp_cc_t* cc, int algorithm, unsigned int max_cwnd) {
+  memset(cc, 0, sizeof(*cc));
+  cc->max_cwnd = max_cwnd;
+  cc->ssthresh = max_cwnd;
+  cc->cwnd = RUDP_CC_INIT_CWND < max_cwnd ? RUDP_CC_INIT_CWND : max_cwnd;
+  return rudp_cc_select(cc, algorithm);
+}
+
+/* Switches algorithm, keeping the current window and RTT history */
+int rudp_cc_select(rudp_cc_t* cc, int algorithm) {
+  if (algorithm < 0 || algorithm >= CC_ALGORITHM_COUNT) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  cc->algorithm = algorithm;
+  cc->ops = &cc_algorithms[algorithm];
+  cc->ops->init(cc);
+  return 0;
+}
+
+void rudp_cc_on_ack(rudp_cc_t* cc, int delivered, long long rtt_us, long long now_us) {
+  cc->delivered = cc->delivered + delivered;
+
+  if (rtt_us > 0) {
+    if (cc->min_rtt_us == 0 || rtt_us <= cc->min_rtt_us ||
+        now_us - cc->min_rtt_stamp_us > RUDP_CC_MIN_RTT_WINDOW_US) {
+      cc->min_rtt_us = rtt_us;
+      cc->min_rtt_stamp_us = now_us;
+    }
+  }
+
+  cc->ops->on_ack(cc, delivered, rtt_us, now_us);
+
+  /* Growing past the send window buys nothing and only delays the backoff */
+  if (cc->cwnd > cc->max_cwnd) {
+    cc->cwnd = cc->max_cwnd;
+  }
+}
+
+void rudp_cc_on_loss(rudp_cc_t* cc, long long now_us) {
+  cc->ops->on_loss(cc, now_us);
+  if (cc->cwnd < RUDP_CC_MIN_CWND) {
+    cc->cwnd = RUDP_CC_MIN_CWND;
+  }
+}
+
+void rudp_cc_on_timeout(rudp_cc_t* cc, long long now_us) {
+  cc->ops->on_timeout(cc, now_us);
+  if (cc->cwnd < RUDP_CC_MIN_CWND) {
+    cc->cwnd = RUDP_CC_MIN_CWND;
+  }
+}
+
+int rudp_cc_window(const rudp_cc_t* cc) {
+  return (int)cc->cwnd;
+}
+
+double rudp_cc_pacing_rate(const rudp_cc_t* cc, long long srtt_us) {
+  if (srtt_us <= 0) {
+    return 0;
+  }
+  if (cc->ops->pacing_rate != NULL) {
+    return cc->ops->pacing_rate(cc, srtt_us);
+  }
+
+  double gain = (cc->cwnd < cc->ssthresh) ? PACING_GAIN_SS : PACING_GAIN_CA;
+  return gain * cc->cwnd * 1e6 / (double)srtt_us;
+}
@@ -0,0 +1,212 @@
+#include <string.h>
+#include <pthread.h>
+#include "include/rudp_crc.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#if defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+/* The reflected Castagnoli polynomial */
+#define CRC32C_POLY 0x82f63b78u
+
+/*
+ * The CRC instructions take a few cycles each but can start one per
+ * cycle, so long buffers are run as three interleaved lanes of
+ * CRC_LANE bytes, joined by shifting the earlier lanes' results past the
+ * later ones with crc_shift_table.
+ */
+#define CRC_LANE 256
+
+typedef uint32_t (*crc_fn)(uint32_t crc, const unsigned char* p, size_t len);
+
+static uint32_t crc_table[8][256];
+static uint32_t crc_shift_table[4][256];
+
+/* The CRC register after CRC_LANE more zero bytes */
+static uint32_t crc_shift(uint32_t crc) {
+  return crc_shift_table[0][crc & 0xff] ^ crc_shift_table[1][(crc >> 8) & 0xff] ^
+         crc_shift_table[2][(crc >> 16) & 0xff] ^ crc_shift_table[3][crc >> 24];
+}
+
+/* Eight bytes per step, one table lookup each, without carried dependencies between them */
+static uint32_t crc32c_sliced(uint32_t crc, const unsigned char* p, size_t len) {
+  while (len >= 8) {
+    uint32_t lo;
+    uint32_t hi;
+    memcpy(&lo, p, sizeof(lo));
+    memcpy(&hi, p + 4, sizeof(hi));
+    lo = lo ^ crc;
+    crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+          crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+          crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^
+          crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+    p = p + 8;
+    len = len - 8;
+  }
+  while (len > 0) {
+    crc = crc_table[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+    p = p + 1;
+    len = len - 1;
+  }
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char* p, size_t len) {
+  while (len >= 3 * CRC_LANE) {
+    uint64_t c0 = crc;
+    uint64_t c1 = 0;
+    uint64_t c2 = 0;
+    for (int i = 0; i < CRC_LANE; i = i + 8) {
+      uint64_t w0;
+      uint64_t w1;
+      uint64_t w2;
+      memcpy(&w0, p + i, sizeof(w0));
+      memcpy(&w1, p + CRC_LANE + i, sizeof(w1));
+      memcpy(&w2, p + 2 * CRC_LANE + i, sizeof(w2));
+      c0 = _mm_crc32_u64(c0, w0);
+      c1 = _mm_crc32_u64(c1, w1);
+      c2 = _mm_crc32_u64(c2, w2);
+    }
+    crc = crc_shift(crc_shift((uint32_t)c0) ^ (uint32_t)c1) ^ (uint32_t)c2;
+    p = p + 3 * CRC_LANE;
+    len = len - 3 * CRC_LANE;
+  }
+
+  uint64_t c = crc;
+  while (len >= 8) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    c = _mm_crc32_u64(c, word);
+    p = p + 8;
+    len = len - 8;
+  }
+  crc = (uint32_t)c;
+  while (len > 0) {
+    crc = _mm_crc32_u8(crc, *p);
+    p = p + 1;
+    len = len - 1;
+  }
+  return crc;
+}
+#endif
+
+#if defined(__aarch64__)
+__attribute__((target("+crc")))
+static uint32_t crc32c_armv8(uint32_t crc, const unsigned char* p, size_t len) {
+  while (len >= 3 * CRC_LANE) {
+    uint32_t c0 = crc;
+    uint32_t c1 = 0;
+    uint32_t c2 = 0;
+    for (int i = 0; i < CRC_LANE; i = i + 8) {
+      uint64_t w0;
+      uint64_t w1;
+      uint64_t w2;
+      memcpy(&w0, p + i, sizeof(w0));
+      memcpy(&w1, p + CRC_LANE + i, sizeof(w1));
+      memcpy(&w2, p + 2 * CRC_LANE + i, sizeof(w2));
+      c0 = __crc32cd(c0, w0);
+      c1 = __crc32cd(c1, w1);
+      c2 = __crc32cd(c2, w2);
+    }
+    crc = crc_shift(crc_shift(c0) ^ c1) ^ c2;
+    p = p + 3 * CRC_LANE;
+    len = len - 3 * CRC_LANE;
+  }
+
+  while (len >= 8) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    crc = __crc32cd(crc, word);
+    p = p + 8;
+    len = len - 8;
+  }
+  while (len > 0) {
+    crc = __crc32cb(crc, *p);
+    p = p + 1;
+    len = len - 1;
+  }
+  return crc;
+}
+#endif
+
+static uint32_t crc32c_pick(uint32_t crc, const unsigned char* p, size_t len);
+
+static crc_fn crc_impl = crc32c_pick;
+static const char* crc_name = "none";
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_setup(void) {
+  for (int i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+    }
+    crc_table[0][i] = crc;
+  }
+  for (int i = 0; i < 256; i++) {
+    for (int k = 1; k < 8; k++) {
+      uint32_t prev = crc_table[k - 1][i];
+      crc_table[k][i] = crc_table[0][prev & 0xff] ^ (prev >> 8);
+    }
+  }
+
+  /* Shifting is linear: the image of each bit, summed over the bits set */
+  static const unsigned char zeros[CRC_LANE];
+  uint32_t bit_shift[32];
+  for (int bit = 0; bit < 32; bit++) {
+    bit_shift[bit] = crc32c_sliced(1u << bit, zeros, CRC_LANE);
+  }
+  for (int k = 0; k < 4; k++) {
+    for (int i = 0; i < 256; i++) {
+      uint32_t shifted = 0;
+      for (int bit = 0; bit < 8; bit++) {
+        if (i & (1 << bit)) {
+          shifted = shifted ^ bit_shift[8 * k + bit];
+        }
+      }
+      crc_shift_table[k][i] = shifted;
+    }
+  }
+
+  crc_fn fn = crc32c_sliced;
+  crc_name = "sliced";
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("sse4.2")) {
+    fn = crc32c_sse42;
+    crc_name = "sse4.2";
+  }
+#elif defined(__aarch64__)
+  if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+    fn = crc32c_armv8;
+    crc_name = "armv8";
+  }
+#endif
+  __atomic_store_n(&crc_impl, fn, __ATOMIC_RELEASE);
+}
+
+static uint32_t crc32c_pick(uint32_t crc, const unsigned char* p, size_t len) {
+  rudp_crc_init();
+  return __atomic_load_n(&crc_impl, __ATOMIC_ACQUIRE)(crc, p, len);
+}
+
+void rudp_crc_init(void) {
+  pthread_once(&crc_once, crc_setup);
+}
+
+const char* rudp_crc_impl(void) {
+  rudp_crc_init();
+  return crc_name;
+}
+
+uint32_t rudp_crc32c(uint32_t crc, const void* buf, size_t len) {
+  crc_fn fn = __atomic_load_n(&crc_impl, __ATOMIC_ACQUIRE);
+  return ~fn(~crc, buf, len);
+}
@@ -0,0 +1,226 @@
+#include <string.h>
+#include <stdint.h>
+#include "include/rudp_lz.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS_MAX 12
+
+/*
+ * Positions probed without a match before the step grows by one byte;
+ * incompressible data is skimmed ever faster instead of hashed in full.
+ */
+#define LZ_SKIP_TRIGGER 6
+
+static uint32_t read32(const unsigned char* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint32_t lz_hash(uint32_t v, int bits) {
+  return (v * 2654435761u) >> (32 - bits);
+}
+
+/* A length in the token nibble and, past 15, in bytes of 255 and a remainder */
+static unsigned char* put_length(unsigned char* out, int n) {
+  while (n >= 255) {
+    *out = 255;
+    out = out + 1;
+    n = n - 255;
+  }
+  *out = (unsigned char)n;
+  return out + 1;
+}
+
+/* How far the data at `at` repeats that at `cand`, known to match for LZ_MIN_MATCH */
+static int match_length(const unsigned char* src, int cand, int at, int len) {
+  int match = LZ_MIN_MATCH;
+  while (at + match + (int)sizeof(uint64_t) <= len) {
+    uint64_t a;
+    uint64_t b;
+    memcpy(&a, src + cand + match, sizeof(a));
+    memcpy(&b, src + at + match, sizeof(b));
+    if (a != b) {
+      /* Little-endian: the lowest differing bit is in the first differing byte */
+      return match + __builtin_ctzll(a ^ b) / 8;
+    }
+    match = match + sizeof(uint64_t);
+  }
+  while (at + match < len && src[cand + match] == src[at + match]) {
+    match = match + 1;
+  }
+  return match;
+}
+
+/* Bytes a sequence takes beyond its literals */
+static int sequence_overhead(int literals, int match) {
+  int n = 1 + 2;
+  if (literals >= 15) n = n + (literals - 15) / 255 + 1;
+  if (match >= 15) n = n + (match - 15) / 255 + 1;
+  return n;
+}
+
+/* A sequence: `literals` bytes from `lit`, then a match at `offset` unless it is 0 */
+static unsigned char* put_sequence(unsigned char* out, const unsigned char* lit, int literals,
+                                   int offset, int match) {
+  unsigned char* token = out;
+  out = out + 1;
+  *token = (unsigned char)((literals < 15 ? literals : 15) << 4);
+  if (literals >= 15) {
+    out = put_length(out, literals - 15);
+  }
+  memcpy(out, lit, literals);
+  out = out + literals;
+
+  if (offset == 0) {
+    return out;
+  }
+  out[0] = (unsigned char)(offset & 0xff);
+  out[1] = (unsigned char)(offset >> 8);
+  out = out + 2;
+  *token = *token | (unsigned char)(match < 15 ? match : 15);
+  if (match >= 15) {
+    out = put_length(out, match - 15);
+  }
+  return out;
+}
+
+int rudp_lz_compress(const char* src_buf, int len, char* dst_buf, int cap) {
+  const unsigned char* src = (const unsigned char*)src_buf;
+  unsigned char* dst = (unsigned char*)dst_buf;
+  unsigned char* out = dst;
+  if (len <= 0 || len > LZ_MAX_OFFSET + 1) {
+    return 0;
+  }
+
+  /* A table sized to the input, so short packets don't pay to clear a big one */
+  int bits = 10;
+  while (bits < LZ_HASH_BITS_MAX && (1 << (bits + 2)) < len) {
+    bits = bits + 1;
+  }
+  uint16_t table[1 << LZ_HASH_BITS_MAX];
+  memset(table, 0, sizeof(uint16_t) << bits);
+
+  int anchor = 0;
+  int i = 0;
+  int misses = 1 << LZ_SKIP_TRIGGER;
+  int limit = len - LZ_MIN_MATCH;
+
+  while (i <= limit) {
+    uint32_t v = read32(src + i);
+    uint32_t h = lz_hash(v, bits);
+    int cand = table[h];
+    table[h] = (uint16_t)i;
+
+    if (cand >= i || i - cand > LZ_MAX_OFFSET || read32(src + cand) != v) {
+      /* Literals pending already fill the room left: give up early */
+      if (i - anchor > cap - (int)(out - dst)) {
+        return 0;
+      }
+      i = i + (misses >> LZ_SKIP_TRIGGER);
+      misses = misses + 1;
+      continue;
+    }
+
+    while (i > anchor && cand > 0 && src[i - 1] == src[cand - 1]) {
+      i = i - 1;
+      cand = cand - 1;
+    }
+    int match = match_length(src, cand, i, len);
+
+    int literals = i - anchor;
+    int extra = match - LZ_MIN_MATCH;
+    if (literals + sequence_overhead(literals, extra) > cap - (int)(out - dst)) {
+      return 0;
+    }
+    out = put_sequence(out, src + anchor, literals, i - cand, extra);
+
+    i = i + match;
+    anchor = i;
+    misses = 1 << LZ_SKIP_TRIGGER;
+    if (i - 2 <= limit) {
+      table[lz_hash(read32(src + i - 2), bits)] = (uint16_t)(i - 2);
+    }
+  }
+
+  /* The rest goes out as a last sequence of literals alone */
+  int literals = len - anchor;
+  int tail = 1 + literals + (literals >= 15 ? (literals - 15) / 255 + 1 : 0);
+  if (tail > cap - (int)(out - dst)) {
+    return 0;
+  }
+  out = put_sequence(out, src + anchor, literals, 0, 0);
+  return (int)(out - dst);
+}
+
+/* Reads an extended length after a nibble of 15; -1 past the end of the input */
+static int get_length(const unsigned char** in, const unsigned char* end, int n) {
+  if (n < 15) {
+    return n;
+  }
+  unsigned char b;
+  do {
+    if (*in >= end) {
+      return -1;
+    }
+    b = **in;
+    *in = *in + 1;
+    n = n + b;
+  } while (b == 255);
+  return n;
+}
+
+int rudp_lz_decompress(const char* src_buf, int len, char* dst_buf, int cap) {
+  const unsigned char* in = (const unsigned char*)src_buf;
+  const unsigned char* in_end = in + len;
+  unsigned char* dst = (unsigned char*)dst_buf;
+  unsigned char* out = dst;
+  unsigned char* out_end = dst + cap;
+
+  while (in < in_end) {
+    int token = *in;
+    in = in + 1;
+
+    int literals = get_length(&in, in_end, token >> 4);
+    if (literals < 0 || literals > in_end - in || literals > out_end - out) {
+      return -1;
+    }
+    memcpy(out, in, literals);
+    out = out + literals;
+    in = in + literals;
+    if (in == in_end) {
+      break;
+    }
+
+    if (in_end - in < 2) {
+      return -1;
+    }
+    int offset = in[0] | (in[1] << 8);
+    in = in + 2;
+    if (offset == 0 || offset > out - dst) {
+      return -1;
+    }
+
+    int match = get_length(&in, in_end, token & 15);
+    if (match < 0) {
+      return -1;
+    }
+    match = match + LZ_MIN_MATCH;
+    if (match > out_end - out) {
+      return -1;
+    }
+
+    const unsigned char* from = out - offset;
+    if (offset >= match) {
+      memcpy(out, from, match);
+    } else {
+      /* Overlapping: a run repeating the last `offset` bytes */
+      for (int k = 0; k < match; k++) {
+        out[k] = from[k];
+      }
+    }
+    out = out + match;
+  }
+  return (int)(out - dst);
+}
@@ -6,8 +6,15 @@
 #include <unistd.h>
 #include <netinet/in.h>
 #include <sys/time.h>
+#include <sys/random.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <errno.h>
-#include "rudp.h"  
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "rudp_conn.h"
+#include "rudp_crc.h"
 
 
 #ifndef RUDP_SYN
@@ -22,8 +29,31 @@
 #define RUDP_FIN 4
 #endif
 
+/*
+ * Handshake retransmission: a SYN or SYN|ACK goes again after
+ * RUDP_SYN_RTO_US, doubling up to RUDP_SYN_RTO_MAX_US, and is given up
+ * after RUDP_SYN_RETRIES resends, a little over 3 s in all.
+ */
+#ifndef RUDP_SYN_RTO_US
+#define RUDP_SYN_RTO_US 20000
+#endif
+
+#ifndef RUDP_SYN_RTO_MAX_US
+#define RUDP_SYN_RTO_MAX_US 1000000
+#endif
+
+#ifndef RUDP_SYN_RETRIES
+#define RUDP_SYN_RETRIES 7
+#endif
+
+/* Fast-open cookies kept from the servers we connected to */
+#ifndef RUDP_COOKIE_CACHE
+#define RUDP_COOKIE_CACHE 64
+#endif
+
 
 int rudp_save_peer(int sock, const struct sockaddr *sa, socklen_t slen);
+int rudp_forget_peer(int sock);
 
 
 
@@ -81,21 +111,470 @@ static void zero_bytes(void *p, size_t n) {
 }
 
 
-static int set_recv_timeout_20ms(int sock) {
+static int set_recv_timeout_us(int sock, long long us) {
     struct timeval tv;
-    tv.tv_sec = 0;
-    tv.tv_usec = 20000;
+    tv.tv_sec = (time_t)(us / 1000000);
+    tv.tv_usec = (suseconds_t)(us % 1000000);
 
     int result = setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
     return result;
 }
 
+static long long mono_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
 
+static long long next_syn_rto(long long rto) {
+    rto = rto * 2;
+    if (rto > RUDP_SYN_RTO_MAX_US) {
+        rto = RUDP_SYN_RTO_MAX_US;
+    }
+    return rto;
+}
 
-int sans_connect(const char *host, int port, int protocol) {
+/* Errors saying an address can't be reached at all, not that a packet was lost */
+static int unreachable(int err) {
+    return err == ENETUNREACH || err == EHOSTUNREACH || err == ENETDOWN ||
+           err == EADDRNOTAVAIL || err == EAFNOSUPPORT;
+}
+
+static void copy_bytes(void *dst, const void *src, size_t n) {
+    unsigned char *d = (unsigned char*)dst;
+    const unsigned char *s = (const unsigned char*)src;
+    size_t i = 0;
+
+    while (i < n) {
+        d[i] = s[i];
+        i = i + 1;
+    }
+}
+
+
+/*
+ * Client side of fast open: the cookie each server last gave us, keyed by
+ * the address we send our SYN to.  The oldest entry makes room for a new one.
+ */
+typedef struct {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    unsigned char cookie[RUDP_COOKIE_LEN];
+    int in_use;
+} cookie_entry_t;
+
+static cookie_entry_t g_cookies[RUDP_COOKIE_CACHE];
+static int g_cookie_next = 0;
+static pthread_mutex_t g_cookie_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int same_addr(const cookie_entry_t *e, const struct sockaddr *sa, socklen_t slen) {
+    if (e->in_use == 0 || e->addrlen != slen) {
+        return 0;
+    }
+
+    const unsigned char *a = (const unsigned char*)&e->addr;
+    const unsigned char *b = (const unsigned char*)sa;
+    socklen_t i = 0;
+    while (i < slen) {
+        if (a[i] != b[i]) {
+            return 0;
+        }
+        i = i + 1;
+    }
+    return 1;
+}
+
+static int cookie_find(const struct sockaddr *sa, socklen_t slen) {
+    int i = 0;
+    while (i < RUDP_COOKIE_CACHE) {
+        if (same_addr(&g_cookies[i], sa, slen)) {
+            return i;
+        }
+        i = i + 1;
+    }
+    return -1;
+}
+
+static int cookie_lookup(const struct sockaddr *sa, socklen_t slen, unsigned char out[RUDP_COOKIE_LEN]) {
+    pthread_mutex_lock(&g_cookie_lock);
+    int idx = cookie_find(sa, slen);
+    if (idx >= 0) {
+        copy_bytes(out, g_cookies[idx].cookie, RUDP_COOKIE_LEN);
+    }
+    pthread_mutex_unlock(&g_cookie_lock);
+    return (idx >= 0) ? 0 : -1;
+}
+
+static void cookie_store(const struct sockaddr *sa, socklen_t slen, const unsigned char cookie[RUDP_COOKIE_LEN]) {
+    if ((size_t)slen > sizeof(struct sockaddr_storage)) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_cookie_lock);
+    int idx = cookie_find(sa, slen);
+    if (idx < 0) {
+        idx = g_cookie_next;
+        g_cookie_next = (g_cookie_next + 1) % RUDP_COOKIE_CACHE;
+        copy_bytes(&g_cookies[idx].addr, sa, (size_t)slen);
+        g_cookies[idx].addrlen = slen;
+        g_cookies[idx].in_use = 1;
+    }
+    copy_bytes(g_cookies[idx].cookie, cookie, RUDP_COOKIE_LEN);
+    pthread_mutex_unlock(&g_cookie_lock);
+}
+
+/* The server no longer hands out cookies; stop sending it data it drops */
+static void cookie_forget(const struct sockaddr *sa, socklen_t slen) {
+    pthread_mutex_lock(&g_cookie_lock);
+    int idx = cookie_find(sa, slen);
+    if (idx >= 0) {
+        g_cookies[idx].in_use = 0;
+    }
+    pthread_mutex_unlock(&g_cookie_lock);
+}
+
+
+/*
+ * Server side: a cookie is SipHash-2-4 of the client's IP address under a
+ * key drawn once per process, so it is checked without keeping any state
+ * and can't be made up for an address by anyone who doesn't receive its
+ * packets.  Cookies stop working when the process restarts.
+ */
+static uint64_t g_cookie_key[2];
+static pthread_once_t g_cookie_key_once = PTHREAD_ONCE_INIT;
+
+static void cookie_key_init(void) {
+    if (getrandom(g_cookie_key, sizeof(g_cookie_key), 0) != (ssize_t)sizeof(g_cookie_key)) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        g_cookie_key[0] = ((uint64_t)ts.tv_sec << 32) ^ (uint64_t)ts.tv_nsec;
+        g_cookie_key[1] = ((uint64_t)getpid() << 32) ^ (uint64_t)(uintptr_t)&ts;
+    }
+}
+
+#define ROTL64(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+static void sip_round(uint64_t v[4]) {
+    v[0] += v[1]; v[1] = ROTL64(v[1], 13); v[1] ^= v[0]; v[0] = ROTL64(v[0], 32);
+    v[2] += v[3]; v[3] = ROTL64(v[3], 16); v[3] ^= v[2];
+    v[0] += v[3]; v[3] = ROTL64(v[3], 21); v[3] ^= v[0];
+    v[2] += v[1]; v[1] = ROTL64(v[1], 17); v[1] ^= v[2]; v[2] = ROTL64(v[2], 32);
+}
+
+static uint64_t siphash(const uint64_t key[2], const unsigned char *in, size_t len) {
+    uint64_t v[4];
+    v[0] = key[0] ^ 0x736f6d6570736575ULL;
+    v[1] = key[1] ^ 0x646f72616e646f6dULL;
+    v[2] = key[0] ^ 0x6c7967656e657261ULL;
+    v[3] = key[1] ^ 0x7465646279746573ULL;
+
+    size_t i = 0;
+    while (i + 8 <= len) {
+        uint64_t m = 0;
+        int j = 0;
+        while (j < 8) {
+            m |= (uint64_t)in[i + j] << (8 * j);
+            j = j + 1;
+        }
+        v[3] ^= m;
+        sip_round(v);
+        sip_round(v);
+        v[0] ^= m;
+        i = i + 8;
+    }
+
+    uint64_t last = (uint64_t)len << 56;
+    int j = 0;
+    while (i + j < len) {
+        last |= (uint64_t)in[i + j] << (8 * j);
+        j = j + 1;
+    }
+    v[3] ^= last;
+    sip_round(v);
+    sip_round(v);
+    v[0] ^= last;
+
+    v[2] ^= 0xff;
+    sip_round(v);
+    sip_round(v);
+    sip_round(v);
+    sip_round(v);
+    return v[0] ^ v[1] ^ v[2] ^ v[3];
+}
+
+static int cookie_make(const struct sockaddr *sa, unsigned char out[RUDP_COOKIE_LEN]) {
+    unsigned char msg[17];
+    size_t len = 0;
+
+    if (sa->sa_family == AF_INET) {
+        const struct sockaddr_in *in4 = (const struct sockaddr_in*)sa;
+        msg[0] = 4;
+        copy_bytes(msg + 1, &in4->sin_addr, 4);
+        len = 5;
+    } else if (sa->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6*)sa;
+        msg[0] = 6;
+        copy_bytes(msg + 1, &in6->sin6_addr, 16);
+        len = 17;
+    } else {
+        return -1;
+    }
+
+    pthread_once(&g_cookie_key_once, cookie_key_init);
+    uint64_t mac = siphash(g_cookie_key, msg, len);
+    copy_bytes(out, &mac, RUDP_COOKIE_LEN);
+    return 0;
+}
+
+static int cookie_valid(const struct sockaddr *sa, const unsigned char cookie[RUDP_COOKIE_LEN]) {
+    unsigned char want[RUDP_COOKIE_LEN];
+    if (cookie_make(sa, want) != 0) {
+        return 0;
+    }
+
+    unsigned char diff = 0;
+    int i = 0;
+    while (i < RUDP_COOKIE_LEN) {
+        diff |= (unsigned char)(want[i] ^ cookie[i]);
+        i = i + 1;
+    }
+    return diff == 0;
+}
+
+
+
+/*
+ * connect() that gives up at `deadline_us` (0 waits as long as the kernel
+ * does) with ETIMEDOUT.
+ */
+static int tcp_connect_until(int fd, const struct sockaddr *sa, socklen_t slen, long long deadline_us) {
+    if (deadline_us == 0) {
+        return connect(fd, sa, slen);
+    }
+
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+        return -1;
+    }
+
+    int ok = connect(fd, sa, slen);
+    if (ok != 0 && errno == EINPROGRESS) {
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        pfd.revents = 0;
+
+        long long left = deadline_us - mono_us();
+        int n = 0;
+        if (left > 0) {
+            n = poll(&pfd, 1, (int)((left + 999) / 1000));
+        }
+
+        if (n == 0) {
+            errno = ETIMEDOUT;
+        } else if (n > 0) {
+            int err = 0;
+            socklen_t errlen = sizeof(err);
+            if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) == 0) {
+                if (err == 0) {
+                    ok = 0;
+                } else {
+                    errno = err;
+                }
+            }
+        }
+    }
+
+    int saved = errno;
+    (void)fcntl(fd, F_SETFL, flags);
+    errno = saved;
+    return ok;
+}
+
+/*
+ * Client side of the RUDP handshake with the address `p`, sending `buf`
+ * along with the SYN when we hold a cookie for it.  Returns 0 once
+ * connected, setting *data_acked if the server took `buf`.  Otherwise
+ * returns -1: ETIMEDOUT when the retries or `deadline_us` (0 for none) run
+ * out, or the error saying the address can't be reached.
+ */
+static int rudp_handshake(int fd, const struct addrinfo *p, const char *buf, int len,
+                          long long deadline_us, int *data_acked) {
+    rudp_syn_packet_t syn_pkt;
+    zero_bytes(&syn_pkt, sizeof(syn_pkt));
+    syn_pkt.hdr.type = RUDP_SYN;
+    syn_pkt.syn.mss = rudp_local_mss();
+
+    /* With a cookie from this server, the first packet goes along */
+    char syn_buf[sizeof(rudp_syn_packet_t) + RUDP_MAX_PAYLOAD];
+    size_t syn_len = sizeof(syn_pkt);
+    int sent_data = 0;
+    if (cookie_lookup(p->ai_addr, (socklen_t)p->ai_addrlen, syn_pkt.syn.cookie) != 0) {
+        syn_pkt.syn.flags = RUDP_SYN_COOKIE_REQ;
+    } else if (buf != 0 && len > 0 && len <= RUDP_MAX_PAYLOAD) {
+        syn_pkt.syn.flags = RUDP_SYN_COOKIE | RUDP_SYN_DATA;
+        copy_bytes(syn_buf + sizeof(syn_pkt), buf, (size_t)len);
+        syn_len = syn_len + (size_t)len;
+        sent_data = 1;
+    }
+    if (rudp_local_crc() != 0) {
+        syn_pkt.syn.flags = syn_pkt.syn.flags | RUDP_SYN_CRC;
+    }
+    if (rudp_local_lz() != 0) {
+        syn_pkt.syn.flags = syn_pkt.syn.flags | RUDP_SYN_LZ;
+    }
+    copy_bytes(syn_buf, &syn_pkt, sizeof(syn_pkt));
+
+    /* ICMP errors are only reported on unconnected sockets if we ask */
+    int recverr_level = (p->ai_family == AF_INET6) ? IPPROTO_IPV6 : IPPROTO_IP;
+    int recverr_opt = (p->ai_family == AF_INET6) ? IPV6_RECVERR : IP_RECVERR;
+    int on = 1;
+    int off = 0;
+    (void)setsockopt(fd, recverr_level, recverr_opt, &on, sizeof(on));
+
+    long long rto = RUDP_SYN_RTO_US;
+    int sends = 0;
+
+    while (sends <= RUDP_SYN_RETRIES) {
+        long long now = mono_us();
+        if (deadline_us != 0 && now >= deadline_us) {
+            break;
+        }
+
+        ssize_t w = sendto(fd,
+                           syn_buf,
+                           syn_len,
+                           0,
+                           p->ai_addr,
+                           (socklen_t)p->ai_addrlen);
+        if (w < 0 && unreachable(errno)) {
+            return -1;
+        }
+        sends = sends + 1;
+
+        long long attempt_end = now + rto;
+        if (deadline_us != 0 && attempt_end > deadline_us) {
+            attempt_end = deadline_us;
+        }
+
+        /* Stray packets don't cut the wait short; only a timeout resends */
+        int waiting = 1;
+        while (waiting == 1) {
+            long long left = attempt_end - mono_us();
+            if (left <= 0) {
+                break;
+            }
+            (void)set_recv_timeout_us(fd, left);
+
+            rudp_syn_packet_t reply;
+            struct sockaddr_storage from;
+            socklen_t fromlen = sizeof(from);
+
+            errno = 0;
+            ssize_t r = recvfrom(fd,
+                                 &reply,
+                                 sizeof(reply),
+                                 0,
+                                 (struct sockaddr*)&from,
+                                 &fromlen);
+
+            if (r < 0) {
+                /* Nothing listens there: no use waiting out the retries */
+                if (errno == ECONNREFUSED || unreachable(errno)) {
+                    return -1;
+                }
+                waiting = 0;
+            } else {
+                int is_syn = (reply.hdr.type & RUDP_SYN) ? 1 : 0;
+                int is_ack = (reply.hdr.type & RUDP_ACK) ? 1 : 0;
+                if (is_syn == 1 && is_ack == 1) {
+
+                    /* A peer that offers no MSS takes RUDP_MAX_PAYLOAD */
+                    int peer_mss = 0;
+                    if (r >= (ssize_t)offsetof(rudp_syn_packet_t, syn.flags)) {
+                        peer_mss = reply.syn.mss;
+                    }
+                    int peer_flags = 0;
+                    if (r >= (ssize_t)sizeof(reply)) {
+                        peer_flags = reply.syn.flags;
+                    }
+
+                    /* From here on the backend reads the socket */
+                    (void)setsockopt(fd, recverr_level, recverr_opt, &off, sizeof(off));
+
+                    if (peer_flags & RUDP_SYN_COOKIE) {
+                        cookie_store(p->ai_addr, (socklen_t)p->ai_addrlen, reply.syn.cookie);
+                    } else if (sent_data == 1 && (peer_flags & RUDP_SYN_DATA_ACKED) == 0) {
+                        cookie_forget(p->ai_addr, (socklen_t)p->ai_addrlen);
+                    }
+
+                    /* Whatever both ends offered is on before the backend sends anything */
+                    int agreed = syn_pkt.syn.flags & peer_flags & (RUDP_SYN_CRC | RUDP_SYN_LZ);
+                    int crc_on = (agreed & RUDP_SYN_CRC) ? 1 : 0;
+
+                    int saved = rudp_save_peer(fd, (struct sockaddr*)&from, fromlen);
+                    if (saved == 0) {
+                        saved = rudp_conn_open(fd, (struct sockaddr*)&from, fromlen, peer_mss, agreed);
+                        if (saved != 0) {
+                            int err = errno;
+                            (void)rudp_forget_peer(fd);
+                            errno = err;
+                        }
+                    }
+                    if (saved != 0) {
+                        return -1;
+                    }
+                    if (sent_data == 1 && (peer_flags & RUDP_SYN_DATA_ACKED)) {
+                        *data_acked = (rudp_conn_syn_acked(fd) == 0);
+                    }
+
+                    rudp_packet_t ack_pkt;
+                    zero_bytes(&ack_pkt, sizeof(ack_pkt));
+                    ack_pkt.type = RUDP_ACK;
+                    ack_pkt.window = RUDP_RWND_SIZE;
+                    ack_pkt.seqnum = -1; /* nothing received yet */
+
+                    /* From now on the server drops whatever comes without a CRC */
+                    char ack_buf[sizeof(rudp_packet_t) + RUDP_CRC_LEN];
+                    size_t ack_len = sizeof(ack_pkt);
+                    if (crc_on == 1) {
+                        ack_pkt.flags = RUDP_HDR_CRC;
+                        uint32_t crc = rudp_crc32c(0, &ack_pkt, sizeof(ack_pkt));
+                        copy_bytes(ack_buf + sizeof(ack_pkt), &crc, sizeof(crc));
+                        ack_len = ack_len + sizeof(crc);
+                    }
+                    copy_bytes(ack_buf, &ack_pkt, sizeof(ack_pkt));
+
+                    (void)sendto(fd,
+                                 ack_buf,
+                                 ack_len,
+                                 0,
+                                 (struct sockaddr*)&from,
+                                 fromlen);
+                    return 0;
+                }
+            }
+        }
+
+        rto = next_syn_rto(rto);
+    }
+
+    errno = ETIMEDOUT;
+    return -1;
+}
+
+/*
+ * Tries each address getaddrinfo gives in turn until one answers, all of
+ * them within `timeout_ms` if that is positive.
+ */
+static int connect_until(const char *host, int port, int protocol, const char *buf, int len, int timeout_ms) {
     if (host == 0) {
         return -1;
     }
+    if (buf != 0 && (len < 0 || len > RUDP_MSS_MAX)) {
+        errno = EMSGSIZE;
+        return -1;
+    }
 
     char service[12];
     int port_result = port_to_str(service, port);
@@ -103,8 +582,14 @@ int sans_connect(const char *host, int port, int protocol) {
         return -1;
     }
 
+    long long deadline_us = 0;
+    if (timeout_ms > 0) {
+        deadline_us = mono_us() + (long long)timeout_ms * 1000;
+    }
+
     if (protocol == IPPROTO_TCP) {
         int final_fd = -1;
+        int err = ECONNREFUSED;
 
         struct addrinfo hints;
         struct addrinfo *results = 0;
@@ -123,14 +608,20 @@ int sans_connect(const char *host, int port, int protocol) {
         while (p != 0) {
             int fd_try = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
             if (fd_try >= 0) {
-                int ok_conn = connect(fd_try, p->ai_addr, p->ai_addrlen);
+                int ok_conn = tcp_connect_until(fd_try, p->ai_addr, p->ai_addrlen, deadline_us);
                 if (ok_conn == 0) {
                     final_fd = fd_try;
                     p = 0;
                     break;
                 } else {
+                    err = errno;
                     close(fd_try);
                 }
+            } else {
+                err = errno;
+            }
+            if (deadline_us != 0 && mono_us() >= deadline_us) {
+                break;
             }
             if (p != 0) {
                 p = p->ai_next;
@@ -138,6 +629,22 @@ int sans_connect(const char *host, int port, int protocol) {
         }
 
         freeaddrinfo(results);
+        if (final_fd < 0) {
+            errno = err;
+            return -1;
+        }
+
+        if (buf != 0) {
+            int sent = 0;
+            while (sent < len) {
+                ssize_t w = send(final_fd, buf + sent, (size_t)(len - sent), 0);
+                if (w < 0) {
+                    close(final_fd);
+                    return -1;
+                }
+                sent = sent + (int)w;
+            }
+        }
         return final_fd;
     }
 
@@ -149,6 +656,8 @@ int sans_connect(const char *host, int port, int protocol) {
 #endif
     {
         int final_fd = -1;
+        int data_acked = 0;
+        int err = ETIMEDOUT;
 
         struct addrinfo hints;
         struct addrinfo *results = 0;
@@ -161,91 +670,41 @@ int sans_connect(const char *host, int port, int protocol) {
         int gai_ok = getaddrinfo(host, service, &hints, &results);
         if (gai_ok != 0 || results == 0) return -1;
 
-        
+        /* An address that times out or can't be reached makes way for the next */
         struct addrinfo *p = results;
-        while (p != 0) {
+        while (p != 0 && final_fd < 0) {
             int fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
             if (fd >= 0) {
-                (void)set_recv_timeout_20ms(fd); 
-
-                
-                rudp_packet_t syn_pkt;
-                zero_bytes(&syn_pkt, sizeof(syn_pkt));
-                syn_pkt.type = RUDP_SYN;
-
-                
-                int connected = 0;
-                while (connected == 0) {
-                    
-                    (void)sendto(fd,
-                                 &syn_pkt,
-                                 sizeof(syn_pkt),
-                                 0,
-                                 p->ai_addr,
-                                 (socklen_t)p->ai_addrlen);
-
-                   
-                    rudp_packet_t reply;
-                    struct sockaddr_storage from;
-                    socklen_t fromlen = sizeof(from);
-
-                    ssize_t r = recvfrom(fd,
-                                         &reply,
-                                         sizeof(reply),
-                                         0,
-                                         (struct sockaddr*)&from,
-                                         &fromlen);
-
-                    if (r < 0) {
-                        if (errno == EAGAIN || errno == EWOULDBLOCK ||
-                            errno == ETIMEDOUT || errno == EINTR) {
-
-                        } else {
-
-                        }
-                    } else {
-
-                        int is_syn = (reply.type & RUDP_SYN) ? 1 : 0;
-                        int is_ack = (reply.type & RUDP_ACK) ? 1 : 0;
-                        if (is_syn == 1 && is_ack == 1) {
-
-                            int saved = rudp_save_peer(fd, (struct sockaddr*)&from, fromlen);
-                            if (saved == 0) {
-
-                                rudp_packet_t ack_pkt;
-                                zero_bytes(&ack_pkt, sizeof(ack_pkt));
-                                ack_pkt.type = RUDP_ACK;
-
-                                (void)sendto(fd,
-                                             &ack_pkt,
-                                             sizeof(ack_pkt),
-                                             0,
-                                             (struct sockaddr*)&from,
-                                             fromlen);
-
-                                final_fd = fd;
-                                connected = 1;
-                            } else {
-
-                            }
-                        } else {
-
-                        }
-                    }
-                }
-
-                if (final_fd >= 0) {
-                    p = 0; 
+                if (rudp_handshake(fd, p, buf, len, deadline_us, &data_acked) == 0) {
+                    final_fd = fd;
                 } else {
+                    err = errno;
                     close(fd);
-                    if (p != 0) p = p->ai_next;
                 }
             } else {
-                p = p->ai_next;
+                err = errno;
             }
+            if (deadline_us != 0 && mono_us() >= deadline_us) {
+                break;
+            }
+            p = p->ai_next;
         }
 
         freeaddrinfo(results);
+        if (final_fd < 0) {
+            errno = err;
+            return -1;
+        }
+
+        /* The server didn't take it with the SYN, or there was no cookie to send */
+        if (buf != 0 && data_acked == 0) {
+            if (sans_send_pkt(final_fd, buf, len) < 0) {
+                int send_err = errno;
+                (void)sans_disconnect(final_fd);
+                errno = send_err;
+                return -1;
+            }
+        }
         return final_fd;
     }
 
@@ -253,6 +712,18 @@ int sans_connect(const char *host, int port, int protocol) {
     return -1;
 }
 
+int sans_connect(const char *host, int port, int protocol) {
+    return connect_until(host, port, protocol, 0, 0, 0);
+}
+
+int sans_connect_send(const char *host, int port, int protocol, const char *buf, int len) {
+    return connect_until(host, port, protocol, buf, len, 0);
+}
+
+int sans_connect_timeout(const char *host, int port, int protocol, int timeout_ms) {
+    return connect_until(host, port, protocol, 0, 0, timeout_ms);
+}
+
 int sans_accept(const char *iface, int port, int protocol) {
     
     char service[12];
@@ -346,81 +817,161 @@ int sans_accept(const char *iface, int port, int protocol) {
         freeaddrinfo(results);
         if (fd < 0) return -1;
 
-        (void)set_recv_timeout_20ms(fd);
-
-        
+        /* Back to waiting for a SYN whenever a client stops answering */
         struct sockaddr_storage from;
         socklen_t fromlen = sizeof(from);
-        rudp_packet_t first;
-        int got_syn = 0;
+        char first_buf[sizeof(rudp_syn_packet_t) + RUDP_MAX_PAYLOAD];
+        rudp_syn_packet_t first;
+        int peer_mss = 0;
+        int agreed = 0;
+        int accepted = 0;
+
+        while (accepted == 0) {
+            (void)set_recv_timeout_us(fd, RUDP_SYN_RTO_US);
+
+            int got_syn = 0;
+            int peer_flags = 0;
+            int data_len = 0;
+            peer_mss = 0;
+
+            while (got_syn == 0) {
+                fromlen = sizeof(from);
+                ssize_t r = recvfrom(fd,
+                                     first_buf,
+                                     sizeof(first_buf),
+                                     0,
+                                     (struct sockaddr*)&from,
+                                     &fromlen);
+
+                if (r < 0) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK ||
+                        errno == ETIMEDOUT || errno == EINTR) {
+                        
+                    } else {
+                        
+                    }
+                } else {
+                    zero_bytes(&first, sizeof(first));
+                    copy_bytes(&first, first_buf, (r < (ssize_t)sizeof(first)) ? (size_t)r : sizeof(first));
+
+                    int is_syn = (first.hdr.type & RUDP_SYN) ? 1 : 0;
+                    if (is_syn == 1) {
+                        got_syn = 1;
+                        /* A peer that offers no MSS takes RUDP_MAX_PAYLOAD */
+                        if (r >= (ssize_t)offsetof(rudp_syn_packet_t, syn.flags)) {
+                            peer_mss = first.syn.mss;
+                        }
+                        if (r >= (ssize_t)sizeof(first)) {
+                            peer_flags = first.syn.flags;
+                        }
+                        if (peer_flags & RUDP_SYN_DATA) {
+                            data_len = (int)(r - (ssize_t)sizeof(first));
+                        }
+                    } else {
+                        
+                    }
+                }
+            }
 
-        while (got_syn == 0) {
-            ssize_t r = recvfrom(fd,
-                                 &first,
-                                 sizeof(first),
-                                 0,
-                                 (struct sockaddr*)&from,
-                                 &fromlen);
+            
+            if (rudp_save_peer(fd, (struct sockaddr*)&from, fromlen) != 0) return -1;
 
-            if (r < 0) {
-                if (errno == EAGAIN || errno == EWOULDBLOCK ||
-                    errno == ETIMEDOUT || errno == EINTR) {
-                    
-                } else {
-                    
+            
+            rudp_syn_packet_t synack;
+            zero_bytes(&synack, sizeof(synack));
+            synack.hdr.type = (RUDP_SYN | RUDP_ACK);
+            synack.hdr.window = RUDP_RWND_SIZE;
+            synack.syn.mss = rudp_local_mss();
+
+            /* What both ends offered, handed to rudp_conn_open() */
+            agreed = 0;
+            if ((peer_flags & RUDP_SYN_CRC) && rudp_local_crc() != 0) {
+                agreed = agreed | RUDP_SYN_CRC;
+            }
+            if ((peer_flags & RUDP_SYN_LZ) && rudp_local_lz() != 0) {
+                agreed = agreed | RUDP_SYN_LZ;
+            }
+            synack.syn.flags = synack.syn.flags | agreed;
+
+            /*
+             * Fast open: data under a valid cookie is delivered at once, and the
+             * connection is up without waiting for the client's ACK, so the
+             * answer can follow the SYN|ACK straight away.  A client that asked
+             * for a cookie, or sent one that no longer works, gets a fresh one.
+             */
+            if (rudp_local_fastopen()) {
+                int fast = 0;
+                if ((peer_flags & RUDP_SYN_DATA) && data_len >= 0) {
+                    fast = cookie_valid((struct sockaddr*)&from, first.syn.cookie);
                 }
-            } else {
-                int is_syn = (first.type & RUDP_SYN) ? 1 : 0;
-                if (is_syn == 1) {
-                    got_syn = 1;
-                } else {
-                    
+
+                if (fast == 1) {
+                    synack.syn.flags = synack.syn.flags | RUDP_SYN_DATA_ACKED;
+                } else if (peer_flags & (RUDP_SYN_COOKIE_REQ | RUDP_SYN_DATA)) {
+                    if (cookie_make((struct sockaddr*)&from, synack.syn.cookie) == 0) {
+                        synack.syn.flags = synack.syn.flags | RUDP_SYN_COOKIE;
+                    }
                 }
-            }
-        }
 
-        
-        if (rudp_save_peer(fd, (struct sockaddr*)&from, fromlen) != 0) return -1;
+                if (fast == 1) {
+                    if (rudp_conn_open(fd, (struct sockaddr*)&from, fromlen, peer_mss, agreed) != 0) {
+                        close(fd);
+                        return -1;
+                    }
+                    if (rudp_conn_syn_data(fd, first_buf + sizeof(first), data_len) != 0) {
+                        (void)sans_disconnect(fd);
+                        return -1;
+                    }
 
-        
-        rudp_packet_t synack;
-        zero_bytes(&synack, sizeof(synack));
-        synack.type = (RUDP_SYN | RUDP_ACK);
+                    /* A retransmitted SYN gets its SYN|ACK from the backend */
+                    (void)sendto(fd,
+                                 &synack,
+                                 sizeof(synack),
+                                 0,
+                                 (struct sockaddr*)&from,
+                                 fromlen);
+                    return fd;
+                }
+            }
 
-        int done = 0;
-        while (done == 0) {
-            (void)sendto(fd,
-                         &synack,
-                         sizeof(synack),
-                         0,
-                         (struct sockaddr*)&from,
-                         fromlen);
+            long long rto = RUDP_SYN_RTO_US;
+            int sends = 0;
+            while (accepted == 0 && sends <= RUDP_SYN_RETRIES) {
+                (void)sendto(fd,
+                             &synack,
+                             sizeof(synack),
+                             0,
+                             (struct sockaddr*)&from,
+                             fromlen);
+                sends = sends + 1;
+                (void)set_recv_timeout_us(fd, rto);
 
-            
-            rudp_packet_t maybe;
-            struct sockaddr_storage tmp;
-            socklen_t tmplen = sizeof(tmp);
-
-            ssize_t rr = recvfrom(fd,
-                                  &maybe,
-                                  sizeof(maybe),
-                                  0,
-                                  (struct sockaddr*)&tmp,
-                                  &tmplen);
-
-            if (rr < 0) {
-                if (errno == EAGAIN || errno == EWOULDBLOCK ||
-                    errno == ETIMEDOUT || errno == EINTR) {
-                    
+                
+                rudp_packet_t maybe;
+                struct sockaddr_storage tmp;
+                socklen_t tmplen = sizeof(tmp);
+
+                ssize_t rr = recvfrom(fd,
+                                      &maybe,
+                                      sizeof(maybe),
+                                      0,
+                                      (struct sockaddr*)&tmp,
+                                      &tmplen);
+
+                if (rr < 0) {
+                    rto = next_syn_rto(rto);
                 } else {
                     
+                    accepted = 1;
                 }
-            } else {
-                
-                done = 1;
             }
         }
 
+        if (rudp_conn_open(fd, (struct sockaddr*)&from, fromlen, peer_mss, agreed) != 0) {
+            close(fd);
+            return -1;
+        }
+
         return fd; 
     }
 
@@ -429,5 +980,8 @@ int sans_accept(const char *iface, int port, int protocol) {
 
 int sans_disconnect(int fd) {
     if (fd < 0) return -1;
+    /* Before the descriptor can be closed and its number handed out again */
+    (void)rudp_forget_peer(fd);
+    if (rudp_conn_close(fd) == 0) return 0; /* backend closes the socket */
     return close(fd);
 }
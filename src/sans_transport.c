@@ -2,10 +2,10 @@
 #include <sys/socket.h>
 #include <errno.h>
 #include <string.h>
-#include "include/rudp.h"
+#include "include/rudp_conn.h"
 
 #ifndef RUDP_ADDRBOOK_CAP
-#define RUDP_ADDRBOOK_CAP 128
+#define RUDP_ADDRBOOK_CAP RUDP_CONN_CAP
 #endif
 
 typedef struct {
@@ -119,19 +119,36 @@ static int addrbook_get(int sock, struct sockaddr *sa, socklen_t *salen) {
     return 0;
 }
 
+static int addrbook_clear(int sock) {
+    int idx = addrbook_find_existing(sock);
+    if (idx < 0) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    g_addrbook[idx].in_use = 0;
+    g_addrbook[idx].addrlen = 0;
+    return 0;
+}
 
 
-extern void enqueue_packet(int sock, const char* buf, int len);
-extern int send_seqnum;
-extern int recv_seqnum;
 
 
 int rudp_save_peer(int sock, const struct sockaddr *sa, socklen_t slen) {
     return addrbook_set(sock, sa, slen);
 }
 
+int rudp_forget_peer(int sock) {
+    return addrbook_clear(sock);
+}
+
 
 int sans_send_pkt(int socket, const char* buf, int len) {
+    if (len < 0 || len > RUDP_MSS_MAX) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
     struct sockaddr_storage peer_addr;
     socklen_t peer_len = (socklen_t)sizeof(peer_addr);
 
@@ -142,52 +159,64 @@ int sans_send_pkt(int socket, const char* buf, int len) {
     }
 
     
-    enqueue_packet(socket, buf, len);
+    return enqueue_packet(socket, buf, len);
+}
+
 
-    return len;
+char* sans_get_buf(int socket) {
+    return loan_buffer(socket);
+}
+
+
+int sans_send_buf(int socket, char* buf, int len) {
+    if (len < 0 || len > RUDP_MSS_MAX) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    struct sockaddr_storage peer_addr;
+    socklen_t peer_len = (socklen_t)sizeof(peer_addr);
+
+    int ok = addrbook_get(socket, (struct sockaddr*)&peer_addr, &peer_len);
+    if (ok != 0) {
+        if (errno == ENOENT) { errno = EDESTADDRREQ; }
+        return -1;
+    }
+
+    return enqueue_buffer(socket, buf, len);
+}
+
+
+int sans_put_buf(int socket, char* buf) {
+    return release_buffer(socket, buf);
 }
 
 
 int sans_recv_pkt(int socket, char* buf, int len) {
-    char pkt_buf[1024];
-    struct sockaddr_storage src_addr;
-    socklen_t src_len = sizeof(src_addr);
+    return dequeue_received(socket, buf, len);
+}
 
-    while (1) {
-        ssize_t recv_bytes = recvfrom(socket, pkt_buf, sizeof(pkt_buf), 0,
-                                       (struct sockaddr*)&src_addr, &src_len);
 
-        if (recv_bytes <= 0) {
-            return -1;
-        }
+int sans_stream_open(int socket) {
+    return stream_open(socket);
+}
 
-        rudp_packet_t* pkt = (rudp_packet_t*)pkt_buf;
 
-        if (pkt->seqnum != recv_seqnum) {
-            rudp_packet_t ack_pkt = {0};
-            ack_pkt.type = ACK;
-            ack_pkt.seqnum = recv_seqnum - 1;
-            sendto(socket, (void*)&ack_pkt, sizeof(ack_pkt), 0,
-                   (struct sockaddr*)&src_addr, src_len);
-            continue;
-        }
+int sans_stream_accept(int socket) {
+    return stream_accept(socket);
+}
 
-        int payload_len = recv_bytes - sizeof(rudp_packet_t);
-        if (payload_len > len) {
-            payload_len = len;
-        }
-        if (payload_len > 0) {
-            memcpy(buf, pkt->payload, payload_len);
-        }
 
-        rudp_packet_t ack_pkt = {0};
-        ack_pkt.type = ACK;
-        ack_pkt.seqnum = recv_seqnum;
-        sendto(socket, (void*)&ack_pkt, sizeof(ack_pkt), 0,
-               (struct sockaddr*)&src_addr, src_len);
+int sans_stream_send(int socket, int stream, const char* buf, int len) {
+    return stream_send(socket, stream, buf, len);
+}
 
-        recv_seqnum++;
 
-        return payload_len;
-    }
+int sans_stream_recv(int socket, int stream, char* buf, int len) {
+    return stream_recv(socket, stream, buf, len);
+}
+
+
+int sans_stream_close(int socket, int stream) {
+    return stream_close(socket, stream);
 }
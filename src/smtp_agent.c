@@ -51,11 +51,29 @@ static int send_cmd_expect(int sock, const char *cmd, const char *code3){
     return starts_with_code(resp, code3) ? 0 : -1;
 }
 
+// body output buffer: on RUDP, one of the socket's own send buffers, so the
+// stuffed body is built in place and never copied again; it holds as much
+// as the path carries unfragmented (*cap)
+static char *take_out(int sock, char *local, int *cap){
+    char *out = sans_get_buf(sock);
+    *cap = out ? rudp_max_payload(sock) : SEND_CHUNK;
+    return out ? out : local;
+}
+static int flush_out(int sock, char **out, int outn, char *local, int *cap){
+    if (*out == local) return send_bytes_chunked(sock, local, outn);
+    int r = sans_send_buf(sock, *out, outn);
+    if (r >= 0) *out = take_out(sock, local, cap); // on failure it is still ours
+    return r;
+}
+
 // dot-stuff body; track if last bytes are CRLF
 static int stream_body_dotstuff(int sock, FILE *fp, int *ends_with_crlf){
-    char in[2048];
-    char out[SEND_CHUNK];
+    char in[8192];
+    char local[SEND_CHUNK];
+    int cap;
+    char *out = take_out(sock, local, &cap);
     int outn = 0;
+    int rc = 0;
 
     int bol = 1;    // beginning-of-line
     int prev_cr = 0;
@@ -65,26 +83,29 @@ static int stream_body_dotstuff(int sock, FILE *fp, int *ends_with_crlf){
         int got = (int)fread(in, 1, sizeof(in), fp);
         if (got <= 0) break;
 
-        for (int i = 0; i < got; i++){
+        for (int i = 0; i < got && rc == 0; i++){
             char c = in[i];
 
             // dot-stuff lines that start with '.'
             if (bol && c == '.'){
-                if (outn >= SEND_CHUNK){ if (send_bytes_chunked(sock, out, outn) < 0) return -1; outn = 0; }
+                if (outn >= cap){ if (flush_out(sock, &out, outn, local, &cap) < 0) rc = -1; outn = 0; }
                 out[outn++] = '.';
             }
 
-            if (outn >= SEND_CHUNK){ if (send_bytes_chunked(sock, out, outn) < 0) return -1; outn = 0; }
+            if (outn >= cap){ if (flush_out(sock, &out, outn, local, &cap) < 0) rc = -1; outn = 0; }
             out[outn++] = c;
 
             if (c == '\r'){ prev_cr = 1; bol = 0; *ends_with_crlf = 0; }
             else if (c == '\n'){ bol = 1; *ends_with_crlf = prev_cr ? 1 : 0; prev_cr = 0; }
             else { bol = 0; prev_cr = 0; *ends_with_crlf = 0; }
         }
+        if (rc < 0) break;
 
-        if (outn > 0){ if (send_bytes_chunked(sock, out, outn) < 0) return -1; outn = 0; }
+        if (outn > 0){ if (flush_out(sock, &out, outn, local, &cap) < 0){ rc = -1; break; } outn = 0; }
     }
-    return 0;
+
+    if (out != local) sans_put_buf(sock, out);
+    return rc;
 }
 
 // ------------------------------- main entry -------------------------------
@@ -0,0 +1,684 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "testing.h"
+#include "sans.h"
+#include "rudp.h"
+#include "rudp_crc.h"
+#include "rudp_lz.h"
+
+#define CRC  1
+#define LZ   2
+#define LOSS 3
+#define STREAMS 4
+#define FOPEN 5
+#define TEARDOWN 6
+
+extern char* s__testdir;
+
+static tests_t tests[] = {
+  {
+    .category = "General",
+    .prompts = {
+      "Program Compiles",
+    }
+  },
+  {
+    .category = "Checksum",
+    .prompts = {
+      "Known CRC32C of \"123456789\"",
+      "Matches bitwise CRC32C at every length and alignment",
+      "Chained calls match a single call",
+      "Every single-bit error is detected"
+    }
+  },
+  {
+    .category = "Compression",
+    .prompts = {
+      "Compressible text round trips",
+      "Round trips at every length",
+      "Long runs use overlapping matches",
+      "Incompressible data is refused",
+      "Malformed input is rejected without overrun"
+    }
+  },
+  {
+    .category = "Lossy Transfer",
+    .prompts = {
+      "Data arrives complete and in order at 5% loss",
+      "FEC rebuilds lost packets",
+      "CRC32C drops corrupted packets",
+      "Compressed data survives loss",
+      "Loaned buffers are compressed"
+    }
+  },
+  {
+    .category = "Streams",
+    .prompts = {
+      "Each stream arrives intact and in order",
+      "A stalled stream does not hold up another"
+    }
+  },
+  {
+    .category = "Fast Open",
+    .prompts = {
+      "A first connect only gets a cookie",
+      "A connect with a cookie sends data with its SYN",
+      "A corrupted cookie falls back to the full handshake"
+    }
+  },
+  {
+    .category = "Teardown",
+    .prompts = {
+      "Packets sent before a disconnect arrive, then the end",
+      "The socket stays open through the linger",
+      "The socket is closed once the linger ends"
+    }
+  }
+};
+
+/* ---- Checksum Tests ---- */
+static uint32_t crc32c_bitwise(const unsigned char* p, size_t len) {
+  uint32_t crc = 0xffffffffu;
+  for (size_t i = 0; i < len; i++) {
+    crc = crc ^ p[i];
+    for (int bit = 0; bit < 8; bit++)
+      crc = (crc & 1) ? (crc >> 1) ^ 0x82f63b78u : crc >> 1;
+  }
+  return ~crc;
+}
+
+static void fill_random(unsigned char* buf, int len, unsigned int seed) {
+  for (int i = 0; i < len; i++)
+    buf[i] = (unsigned char)rand_r(&seed);
+}
+
+static void run_crc_tests(void) {
+  static unsigned char buf[4096 + 8];
+  fill_random(buf, sizeof(buf), 1);
+
+  assert(rudp_crc32c(0, "123456789", 9) == 0xe3069283u, tests[CRC].results[0],
+	 "FAIL - CRC32C of \"123456789\" was not 0xe3069283");
+
+  /* Past three 256-byte lanes, so the interleaved path and its tail are both covered */
+  int same = 1;
+  for (int len = 0; len <= 2048 && same; len++) {
+    for (int off = 0; off < 8 && same; off += (len < 1024 ? 1 : 3))
+      same = rudp_crc32c(0, buf + off, len) == crc32c_bitwise(buf + off, len);
+  }
+  assert(same, tests[CRC].results[1], "FAIL - CRC32C differed from the bitwise definition");
+
+  uint32_t whole = rudp_crc32c(0, buf, 4096);
+  for (int split = 0; split <= 4096; split += 61) {
+    uint32_t crc = rudp_crc32c(rudp_crc32c(0, buf, split), buf + split, 4096 - split);
+    assert(crc == whole, tests[CRC].results[2], "FAIL - CRC32C of two pieces differed from the whole");
+  }
+
+  uint32_t base = rudp_crc32c(0, buf, 1500);
+  for (int bit = 0; bit < 1500 * 8; bit++) {
+    buf[bit / 8] ^= (unsigned char)(1 << (bit % 8));
+    int changed = rudp_crc32c(0, buf, 1500) != base;
+    buf[bit / 8] ^= (unsigned char)(1 << (bit % 8));
+    if (!assert(changed, tests[CRC].results[3], "FAIL - A flipped bit left the CRC32C unchanged"))
+      break;
+  }
+
+  printf("CRC32C implementation: %s\n", rudp_crc_impl());
+}
+
+/* ---- Compression Tests ---- */
+static const char* phrases[] = {
+  "GET /index.html HTTP/1.1\r\n",
+  "Host: localhost\r\n",
+  "Content-Type: text/plain\r\n",
+  "Connection: keep-alive\r\n\r\n",
+};
+
+static int fill_text(char* buf, int len, unsigned int seed) {
+  int at = 0;
+  while (at < len) {
+    const char* p = phrases[rand_r(&seed) % 4];
+    int n = strlen(p);
+    if (n > len - at)
+      n = len - at;
+    memcpy(buf + at, p, n);
+    at += n;
+    if (at < len && rand_r(&seed) % 3 == 0)
+      buf[at++] = (char)('0' + rand_r(&seed) % 10);
+  }
+  return len;
+}
+
+static int round_trip(const char* src, int len, int cap) {
+  static char packed[70000];
+  static char unpacked[70000];
+  int n = rudp_lz_compress(src, len, packed, cap);
+  if (n <= 0)
+    return n;
+  if (rudp_lz_decompress(packed, n, unpacked, len) != len || memcmp(src, unpacked, len) != 0)
+    return -1;
+  return n;
+}
+
+static void run_lz_tests(void) {
+  static char buf[65536];
+
+  fill_text(buf, 8192, 2);
+  int n = round_trip(buf, 8192, 8192 - 1);
+  assert(n >= 0, tests[LZ].results[0], "FAIL - Decompressed text did not match the original");
+  assert(n > 0 && n < 8192 / 2, tests[LZ].results[0], "FAIL - Repetitive text did not compress to under half");
+
+  for (int len = 1; len <= 1500; len++) {
+    fill_text(buf, len, len);
+    if (len % 5 == 0)
+      fill_random((unsigned char*)buf + len / 2, len - len / 2, len);
+    if (!assert(round_trip(buf, len, len - 1) >= 0, tests[LZ].results[1],
+		"FAIL - A compressed packet did not decompress to the original"))
+      break;
+  }
+
+  memset(buf, 'a', 60000);
+  buf[30000] = 'b';
+  n = round_trip(buf, 60000, 60000 - 1);
+  assert(n >= 0, tests[LZ].results[2], "FAIL - A long run did not decompress to the original");
+  assert(n > 0 && n < 600, tests[LZ].results[2], "FAIL - A long run did not compress to a few hundred bytes");
+
+  fill_random((unsigned char*)buf, 1400, 3);
+  assert(round_trip(buf, 1400, 1400 - 1400 / 16) == 0, tests[LZ].results[3],
+	 "FAIL - Random data was compressed into less than a sixteenth of gain");
+
+  /* Truncated and corrupted streams must fail or stay within `cap`, never write past it */
+  static char packed[4096];
+  static char out[1024 + 64];
+  fill_text(buf, 1024, 4);
+  int packed_len = rudp_lz_compress(buf, 1024, packed, sizeof(packed));
+  unsigned int seed = 5;
+  for (int trial = 0; trial < 20000 && packed_len > 0; trial++) {
+    static char bad[4096];
+    int len = packed_len;
+    memcpy(bad, packed, len);
+    if (trial < packed_len)
+      len = trial;
+    else
+      bad[rand_r(&seed) % len] = (char)rand_r(&seed);
+
+    memset(out, 0x5a, sizeof(out));
+    int r = rudp_lz_decompress(bad, len, out, 1024);
+    int overrun = 0;
+    for (int i = 1024; i < (int)sizeof(out); i++)
+      overrun |= out[i] != 0x5a;
+    if (!assert(r >= -1 && r <= 1024 && !overrun, tests[LZ].results[4],
+		"FAIL - Malformed input was decompressed past the output buffer"))
+      break;
+  }
+  assert(packed_len > 0, tests[LZ].results[4], "FAIL - Could not compress the sample to corrupt");
+}
+
+/* ---- Lossy Transfer Tests ---- */
+
+/*
+ * A UDP relay between the client and the server that drops, or flips a bit
+ * in, a share of the DAT and ACK packets passing either way.  With
+ * `mangle_cookie` it also spoils the cookie of any SYN carrying data.
+ */
+typedef struct {
+  int front;
+  int back;
+  struct sockaddr_in server;
+  struct sockaddr_in client;
+  int have_client;
+  int loss_permille;
+  int flip_permille;
+  int mangle_cookie;
+  unsigned int seed;
+  pthread_t thread;
+  volatile int running;
+} relay_t;
+
+static void* relay_loop(void* arg) {
+  relay_t* relay = arg;
+  static char buf[65536];
+  struct pollfd fds[2] = { { .fd = relay->front, .events = POLLIN }, { .fd = relay->back, .events = POLLIN } };
+
+  while (relay->running) {
+    if (poll(fds, 2, 20) <= 0)
+      continue;
+    for (int i = 0; i < 2; i++) {
+      if ((fds[i].revents & POLLIN) == 0)
+	continue;
+      struct sockaddr_in from;
+      socklen_t fromlen = sizeof(from);
+      ssize_t len = recvfrom(fds[i].fd, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr*)&from, &fromlen);
+      if (len <= 0)
+	continue;
+
+      if (i == 0 && relay->mangle_cookie && buf[0] == SYN && len > (ssize_t)sizeof(rudp_syn_packet_t))
+	buf[offsetof(rudp_syn_packet_t, syn.cookie)] ^= 1;
+
+      if (len > 8 && (buf[0] == DAT || buf[0] == ACK)) {
+	int roll = rand_r(&relay->seed) % 1000;
+	if (roll < relay->loss_permille)
+	  continue;
+	if (buf[0] == DAT && roll < relay->loss_permille + relay->flip_permille) {
+	  int bit = rand_r(&relay->seed) % (len * 8);
+	  buf[bit / 8] ^= (char)(1 << (bit % 8));
+	}
+      }
+
+      if (i == 0) {
+	relay->client = from;
+	relay->have_client = 1;
+	sendto(relay->back, buf, len, 0, (struct sockaddr*)&relay->server, sizeof(relay->server));
+      }
+      else if (relay->have_client) {
+	sendto(relay->front, buf, len, 0, (struct sockaddr*)&relay->client, sizeof(relay->client));
+      }
+    }
+  }
+  return NULL;
+}
+
+#define TRANSFER_PACKETS 2000
+
+static int server_port;
+static int server_sock;
+
+static void* accept_thread(void* unused) {
+  server_sock = sans_accept("127.0.0.1", server_port, IPPROTO_RUDP);
+  return NULL;
+}
+
+static int make_packet(int i, char* buf) {
+  int len = 200 + (i * 37) % 1000;
+  fill_text(buf, len, i);
+  memcpy(buf, &i, sizeof(i));
+  return len;
+}
+
+/* Whether send_thread builds its packets in buffers from sans_get_buf */
+static int send_loaned;
+
+static void* send_thread(void* arg) {
+  int sock = *(int*)arg;
+  char buf[1200];
+  for (int i = 0; i < TRANSFER_PACKETS; i++) {
+    int len = make_packet(i, buf);
+    if (send_loaned) {
+      char* loan = sans_get_buf(sock);
+      if (loan == NULL)
+	break;
+      memcpy(loan, buf, len);
+      if (sans_send_buf(sock, loan, len) != len) {
+	sans_put_buf(sock, loan);
+	break;
+      }
+    }
+    else if (sans_send_pkt(sock, buf, len) != len)
+      break;
+  }
+  return NULL;
+}
+
+/*
+ * Moves TRANSFER_PACKETS packets from a client to a server through a relay
+ * losing `loss` and corrupting `flip` packets per thousand.  Returns 0 if
+ * every one arrived intact and in order, and the server's stats.
+ */
+static int next_port(void) {
+  static int port_base = 0;
+  if (port_base == 0)
+    port_base = 20000 + getpid() % 20000;
+  return port_base++;
+}
+
+/* Starts `relay` forwarding from `relay_port` to server_port */
+static int relay_start(relay_t* relay, int relay_port) {
+  relay->front = socket(AF_INET, SOCK_DGRAM, 0);
+  relay->back = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in front_addr = { .sin_family = AF_INET, .sin_port = htons(relay_port) };
+  inet_pton(AF_INET, "127.0.0.1", &front_addr.sin_addr);
+  relay->server = front_addr;
+  relay->server.sin_port = htons(server_port);
+  if (bind(relay->front, (struct sockaddr*)&front_addr, sizeof(front_addr)) != 0) {
+    close(relay->front);
+    close(relay->back);
+    return -1;
+  }
+  relay->running = 1;
+  pthread_create(&relay->thread, NULL, relay_loop, relay);
+  return 0;
+}
+
+static void relay_stop(relay_t* relay) {
+  relay->running = 0;
+  pthread_join(relay->thread, NULL);
+  close(relay->front);
+  close(relay->back);
+}
+
+static int run_transfer(int loss, int flip, rudp_stats_t* client_stats, rudp_stats_t* server_stats) {
+  server_port = next_port();
+  int relay_port = next_port();
+
+  relay_t relay = { .loss_permille = loss, .flip_permille = flip, .seed = 7 };
+  if (relay_start(&relay, relay_port) != 0)
+    return -1;
+
+  pthread_t accept_tid, send_tid;
+  pthread_create(&accept_tid, NULL, accept_thread, NULL);
+  usleep(20000);
+
+  int sock = sans_connect("127.0.0.1", relay_port, IPPROTO_RUDP);
+  pthread_join(accept_tid, NULL);
+  int bad = (sock < 0 || server_sock < 0);
+
+  if (!bad) {
+    pthread_create(&send_tid, NULL, send_thread, &sock);
+    char got[1200], want[1200];
+    /* Read everything even past a mismatch, so the sender is never left blocked */
+    for (int i = 0; i < TRANSFER_PACKETS; i++) {
+      int len = make_packet(i, want);
+      if (sans_recv_pkt(server_sock, got, sizeof(got)) != len || memcmp(got, want, len) != 0)
+	bad = 1;
+    }
+    pthread_join(send_tid, NULL);
+    rudp_get_stats(sock, client_stats);
+    rudp_get_stats(server_sock, server_stats);
+  }
+
+  if (sock >= 0)
+    sans_disconnect(sock);
+  if (server_sock >= 0)
+    sans_disconnect(server_sock);
+  relay_stop(&relay);
+  return bad ? -1 : 0;
+}
+
+static void run_loss_tests(void) {
+  rudp_stats_t cs, ss;
+  rudp_configure(RUDP_OPT_LINGER, 100);
+
+  int result = run_transfer(50, 0, &cs, &ss);
+  assert(result == 0, tests[LOSS].results[0], "FAIL - Data was lost, corrupted or reordered at 5% loss");
+
+  rudp_configure(RUDP_OPT_FEC, 4);
+  result = run_transfer(50, 0, &cs, &ss);
+  rudp_configure(RUDP_OPT_FEC, 0);
+  assert(result == 0, tests[LOSS].results[1], "FAIL - Data was lost, corrupted or reordered with FEC on");
+  assert(ss.fec_recovered > 0, tests[LOSS].results[1], "FAIL - No lost packet was rebuilt from parity");
+
+  rudp_configure(RUDP_OPT_CRC, 1);
+  result = run_transfer(0, 20, &cs, &ss);
+  rudp_configure(RUDP_OPT_CRC, 0);
+  assert(result == 0, tests[LOSS].results[2], "FAIL - A corrupted packet reached the application");
+  assert(ss.crc == 1 && cs.crc == 1, tests[LOSS].results[2], "FAIL - CRC32C was not negotiated");
+  assert(ss.crc_errors > 0, tests[LOSS].results[2], "FAIL - No corrupted packet was counted as a CRC error");
+
+  rudp_configure(RUDP_OPT_COMPRESS, 1);
+  result = run_transfer(50, 0, &cs, &ss);
+  rudp_configure(RUDP_OPT_COMPRESS, 0);
+  assert(result == 0, tests[LOSS].results[3], "FAIL - Compressed data was lost, corrupted or reordered");
+  assert(cs.compress == 1 && cs.lz_packets > 0, tests[LOSS].results[3], "FAIL - No packet was sent compressed");
+
+  rudp_configure(RUDP_OPT_COMPRESS, 1);
+  send_loaned = 1;
+  result = run_transfer(50, 0, &cs, &ss);
+  send_loaned = 0;
+  rudp_configure(RUDP_OPT_COMPRESS, 0);
+  assert(result == 0, tests[LOSS].results[4], "FAIL - Data sent from loaned buffers was lost, corrupted or reordered");
+  assert(cs.lz_packets > 0, tests[LOSS].results[4], "FAIL - No loaned buffer was sent compressed");
+}
+
+/* ---- Stream Tests ---- */
+#define STREAM_PACKETS 200
+
+typedef struct {
+  int sock;
+  int stream;
+  int tag;
+  volatile int done;
+} stream_sender_t;
+
+static int make_stream_packet(int tag, int i, char* buf) {
+  int len = 100 + (i * 53) % 800;
+  fill_text(buf, len, tag * STREAM_PACKETS + i);
+  memcpy(buf, &tag, sizeof(tag));
+  memcpy(buf + sizeof(tag), &i, sizeof(i));
+  return len;
+}
+
+static void* stream_send_thread(void* arg) {
+  stream_sender_t* sender = arg;
+  char buf[1000];
+  for (int i = 0; i < STREAM_PACKETS; i++) {
+    int len = make_stream_packet(sender->tag, i, buf);
+    if (sans_stream_send(sender->sock, sender->stream, buf, len) != len)
+      break;
+  }
+  sans_stream_close(sender->sock, sender->stream);
+  sender->done = 1;
+  return NULL;
+}
+
+/*
+ * Reads `stream` to its end.  Returns the tag its packets carry if all
+ * STREAM_PACKETS of them arrived intact and in order, otherwise -1.
+ */
+static int drain_stream(int sock, int stream) {
+  char got[1000], want[1000];
+  int tag = -1, bad = 0, count = 0, len;
+  while ((len = sans_stream_recv(sock, stream, got, sizeof(got))) > 0) {
+    if (tag < 0 && len >= (int)sizeof(tag))
+      memcpy(&tag, got, sizeof(tag));
+    if (count >= STREAM_PACKETS || len != make_stream_packet(tag, count, want) || memcmp(got, want, len) != 0)
+      bad = 1;
+    count++;
+  }
+  return (bad || len < 0 || count != STREAM_PACKETS) ? -1 : tag;
+}
+
+static void run_stream_tests(void) {
+  server_port = next_port();
+  pthread_t accept_tid;
+  pthread_create(&accept_tid, NULL, accept_thread, NULL);
+  usleep(20000);
+  int sock = sans_connect("127.0.0.1", server_port, IPPROTO_RUDP);
+  pthread_join(accept_tid, NULL);
+  if (!assert(sock >= 0 && server_sock >= 0, tests[STREAMS].results[0], "FAIL - Could not connect"))
+    return;
+
+  /* Each sender outruns the stream's credit, so it blocks until its stream is read */
+  stream_sender_t senders[2];
+  pthread_t send_tids[2];
+  for (int i = 0; i < 2; i++) {
+    senders[i] = (stream_sender_t){ .sock = sock, .stream = sans_stream_open(sock), .tag = i };
+    pthread_create(&send_tids[i], NULL, stream_send_thread, &senders[i]);
+  }
+
+  int first = sans_stream_accept(server_sock);
+  int second = sans_stream_accept(server_sock);
+  assert(first > 0 && second > 0 && first != second, tests[STREAMS].results[0],
+	 "FAIL - The server did not accept two streams");
+
+  /* The first stream goes unread until the second has ended */
+  int second_tag = drain_stream(server_sock, second);
+  assert(second_tag >= 0, tests[STREAMS].results[1], "FAIL - A stream was cut short while another was stalled");
+  assert(second_tag >= 0 && !senders[1 - second_tag].done, tests[STREAMS].results[1],
+	 "FAIL - A stream was sent past its credit while its reader was stalled");
+
+  int first_tag = drain_stream(server_sock, first);
+  assert(first_tag >= 0 && second_tag >= 0 && first_tag != second_tag, tests[STREAMS].results[0],
+	 "FAIL - Stream data was lost, corrupted, reordered or mixed up");
+
+  for (int i = 0; i < 2; i++)
+    pthread_join(send_tids[i], NULL);
+  sans_disconnect(sock);
+  sans_disconnect(server_sock);
+}
+
+/* ---- Fast Open Tests ---- */
+
+/*
+ * Connects with sans_connect_send through a fresh relay on `relay_port`,
+ * so the client always sees the same server and keeps its cookie for it.
+ * Returns 0 if the server got the data exactly once, and the server's stats.
+ */
+static int fast_open(int relay_port, int mangle_cookie, rudp_stats_t* server_stats) {
+  static const char request[] = "GET /index.html HTTP/1.1\r\n\r\n";
+  static const char after[] = "after";
+  server_port = next_port();
+
+  relay_t relay = { .mangle_cookie = mangle_cookie, .seed = 7 };
+  if (relay_start(&relay, relay_port) != 0)
+    return -1;
+
+  pthread_t accept_tid;
+  pthread_create(&accept_tid, NULL, accept_thread, NULL);
+  usleep(20000);
+
+  int sock = sans_connect_send("127.0.0.1", relay_port, IPPROTO_RUDP, request, sizeof(request));
+  pthread_join(accept_tid, NULL);
+  int bad = (sock < 0 || server_sock < 0);
+
+  if (!bad) {
+    /* A copy of the SYN's data delivered as well would turn up in place of `after` */
+    char got[256];
+    bad = sans_send_pkt(sock, after, sizeof(after)) != sizeof(after);
+    if (sans_recv_pkt(server_sock, got, sizeof(got)) != sizeof(request) || memcmp(got, request, sizeof(request)) != 0)
+      bad = 1;
+    if (sans_recv_pkt(server_sock, got, sizeof(got)) != sizeof(after) || memcmp(got, after, sizeof(after)) != 0)
+      bad = 1;
+    rudp_get_stats(server_sock, server_stats);
+  }
+
+  if (sock >= 0)
+    sans_disconnect(sock);
+  if (server_sock >= 0)
+    sans_disconnect(server_sock);
+  relay_stop(&relay);
+  return bad ? -1 : 0;
+}
+
+static void run_fast_open_tests(void) {
+  rudp_stats_t ss;
+  int relay_port = next_port();
+  rudp_configure(RUDP_OPT_FASTOPEN, 1);
+
+  int result = fast_open(relay_port, 0, &ss);
+  assert(result == 0, tests[FOPEN].results[0], "FAIL - The data of a first connect was lost or repeated");
+  assert(result == 0 && ss.fastopen == 0, tests[FOPEN].results[0], "FAIL - Data rode on a SYN without a cookie");
+
+  result = fast_open(relay_port, 0, &ss);
+  assert(result == 0, tests[FOPEN].results[1], "FAIL - Data sent with the SYN was lost or repeated");
+  assert(result == 0 && ss.fastopen == 1, tests[FOPEN].results[1], "FAIL - The cookie did not let data ride on the SYN");
+
+  result = fast_open(relay_port, 1, &ss);
+  assert(result == 0, tests[FOPEN].results[2], "FAIL - Data under a corrupted cookie was lost or repeated");
+  assert(result == 0 && ss.fastopen == 0, tests[FOPEN].results[2], "FAIL - Data under a corrupted cookie was accepted");
+}
+
+/* ---- Teardown Tests ---- */
+#define TEARDOWN_PACKETS 500
+#define TEARDOWN_LINGER_MS 200
+
+static int open_after_close;
+
+static void* send_close_thread(void* arg) {
+  int sock = *(int*)arg;
+  char buf[1200];
+  for (int i = 0; i < TEARDOWN_PACKETS; i++) {
+    int len = make_packet(i, buf);
+    if (sans_send_pkt(sock, buf, len) != len)
+      break;
+  }
+  sans_disconnect(sock);
+  open_after_close = fcntl(sock, F_GETFD) != -1;
+  return NULL;
+}
+
+static void run_teardown_tests(void) {
+  rudp_configure(RUDP_OPT_LINGER, TEARDOWN_LINGER_MS);
+  server_port = next_port();
+  pthread_t accept_tid, send_tid;
+  pthread_create(&accept_tid, NULL, accept_thread, NULL);
+  usleep(20000);
+  int sock = sans_connect("127.0.0.1", server_port, IPPROTO_RUDP);
+  pthread_join(accept_tid, NULL);
+  if (!assert(sock >= 0 && server_sock >= 0, tests[TEARDOWN].results[0], "FAIL - Could not connect"))
+    return;
+
+  pthread_create(&send_tid, NULL, send_close_thread, &sock);
+  char got[1200], want[1200];
+  int bad = 0;
+  for (int i = 0; i < TEARDOWN_PACKETS; i++) {
+    int len = make_packet(i, want);
+    if (sans_recv_pkt(server_sock, got, sizeof(got)) != len || memcmp(got, want, len) != 0)
+      bad = 1;
+  }
+  assert(!bad, tests[TEARDOWN].results[0], "FAIL - Data sent before the disconnect was lost, corrupted or reordered");
+  assert(sans_recv_pkt(server_sock, got, sizeof(got)) == 0, tests[TEARDOWN].results[0],
+	 "FAIL - The receiver did not see the end of the connection");
+  pthread_join(send_tid, NULL);
+
+  /* The server keeps its end open, so only the linger can close the client's */
+  assert(open_after_close, tests[TEARDOWN].results[1], "FAIL - The socket was closed before the linger ended");
+  int closed = 0;
+  for (int waited = 0; waited < 4 * TEARDOWN_LINGER_MS && !closed; waited += 10) {
+    usleep(10000);
+    closed = fcntl(sock, F_GETFD) == -1 && errno == EBADF;
+  }
+  assert(closed, tests[TEARDOWN].results[2], "FAIL - The socket was still open long after the linger");
+
+  sans_disconnect(server_sock);
+}
+
+void t__p7_tests(void) {
+  char out[128], err[128];
+
+  s__initialize_tests(tests, 7);
+
+  if (s__testdir == NULL) {
+#ifdef HEADLESS
+    s__dump_stdout("test.out", "test.err");
+#else
+    s__dump_stdout();
+#endif
+  }
+  else {
+    snprintf(out, sizeof(out), "%s/stdout", s__testdir);
+    snprintf(err, sizeof(err), "%s/stderr", s__testdir);
+#ifdef HEADLESS
+    s__dump_stdout(out, err);
+#else
+    s__dump_stdout();
+#endif
+  }
+
+  assert(1, tests[0].results[0], "");
+
+  run_crc_tests();
+  run_lz_tests();
+
+  { /*  Transport Driver thread  */
+    pthread_t backend_thread;
+    int result = pthread_create(&backend_thread, NULL, rudp_backend, NULL);
+    if (result != 0) {
+      fprintf(stderr, "Failed to create background worker thread\n");
+      exit(-1);
+    }
+  }
+
+  run_loss_tests();
+  run_stream_tests();
+  run_fast_open_tests();
+  run_teardown_tests();
+}